@@ -1,21 +1,99 @@
 #include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <climits>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
+#include <set>
 #include <vector>
+#include <map>
+#include <memory>
 #include <atomic>
+#include <algorithm>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <system_error>
+#include <deque>
 #include <time.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <linux/magic.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "dircache.h"
 
 // Uncomment to enable drop-in functionality
 //#define DIRCACHE_DROPIN
 
+#ifndef FUSE_SUPER_MAGIC
+#define FUSE_SUPER_MAGIC 0x65735546
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // Struct decls
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * A populate queued in dc_admit, woken on its own cv when admitted
+ */
+struct dc_admit_waiter_t {
+	std::condition_variable cv;
+	bool admitted = false;
+};
+
+/**
+ * Fair counting semaphore for populates. Waiters are admitted strictly in
+ * arrival order, so a burst of misses drains at a steady rate.
+ */
+struct dc_admission_t {
+	std::mutex lock;
+	std::deque<dc_admit_waiter_t*> queue;	// Oldest first
+	int running = 0;						// Admitted and not yet left
+};
+
+/**
+ * Per-mount state. Created the first time a directory on a given
+ * st_dev is populated and kept for the life of the process.
+ * The policy is copied out of the fs policy table by f_type.
+ */
+struct dc_mount_t {
+	dev_t dev;
+	long ftype;
+	
+	// Policy, see dircache_policy_t
+	std::atomic<double> ttl_ms;
+	std::atomic_int validate;
+	std::atomic_int stat_prefetch;
+	std::atomic_int max_concurrent;
+	std::atomic<double> max_stale_ms;
+	
+	dc_admission_t admit;			// Populate admission, limited by max_concurrent
+};
+
+/**
+ * Packed per-entry columns used by the built-in scandir filters.
+ * Built once per listing on first use, see dc_columns_for.
+ */
+struct dc_columns_t {
+	std::vector<uint64_t> ext;		// Extension (after the last '.') zero padded to 8 bytes, 0 if none
+	std::vector<uint64_t> head;		// First 8 bytes of the name, zero padded
+	std::vector<uint8_t> extlong;	// Extension doesn't fit in 8 bytes, check it by hand
+};
+
 /**
  * dirent_t represents a directory entry on the disk
  * These have a vector of entries, an atomic ref count 
@@ -24,22 +102,117 @@
  * will be purged from the db and replaced with fresh entries.
  * Stale entries only get purged when their refcount reaches 0
  * Thus, it's important to dirclose 
+ * Entries may also hold a pooled O_PATH fd on the directory, which is
+ * used to revalidate and repopulate without walking the path again.
+ * The ref count starts out as a single counter and is split across
+ * per-thread shards once the entry is hot, see dc_ref.
+ * Fields are grouped by cache line: what lookups and readdir read first,
+ * then the ref count which every open/close writes, then the cold
+ * revalidation state, so readers don't false share with ref count writers.
  */
+struct dc_refshard_t;
+struct dc_changeset_t;
+
 struct dirent_t {
+	// Read-mostly, everything a lookup and readdir touch
+	alignas(64) size_t hash;		// Hash of path
+	std::string path;				// Key in the db
 	std::vector<dirent> entries;	// List of entries
-	std::atomic_uint32_t nref;		// Ref count from dirdbcontext-s
-	double addedat;					// When this entry was added to the db
+	std::atomic<double> addedat;	// When this entry was added (or last revalidated)
+	std::atomic_bool stale;			// Set once replaced in the db, purged when nref hits 0
+	uint64_t version;				// Publication order, increases every time a path is (re)populated
+	uint64_t gen;					// Cache generation this listing was read in
+	dc_mount_t* mount;				// Mount this directory lives on
+	dircache_t* cache;				// Cache instance this entry belongs to
+	std::atomic_uint8_t prefetched {0};	// DC_PREFETCH_xxx if loaded ahead of demand and not yet used
+	bool cold = false;				// Listing is in packed rather than entries, see the cold tier
+	
+	// Written by every open and close, until split
+	alignas(64) std::atomic_int64_t nref;	// Ref count from dirdbcontext-s
+	std::atomic<dc_refshard_t*> nrefshards {nullptr}; // Split ref count, once hot
+	std::atomic_bool frozen {false};	// Stale and refs go to nref only, see dc_purge_stale
+	uint64_t frozeat = 0;				// Epoch it was frozen in. Guarded by the stale list lock
+	std::atomic<uint64_t> accesses {0};	// Approximate lookups, sampled, see dc_count_access
+	std::atomic<double> usedat {0};		// Last lookup, to the reclaimer's clock. See dc_touch
+	
+	// Revalidation, filtering and fd pool state
+	alignas(64) struct stat st;		// Stat of the directory itself at populate time
+	std::atomic<dc_columns_t*> columns {nullptr}; // Built-in filter columns, once used
+	std::atomic_bool refreshing {false};	// A background refresh is queued
+	int depth = 0;					// Levels below the demand opened directory that prefetched it
+	std::vector<std::shared_ptr<const dc_changeset_t>> history; // Changes leading up to this version, oldest first
+	dirent_t* prev = nullptr;		// Older version kept for snapshots, referenced. Guarded by the cache's snaplock
+	std::string packed;				// Front coded listing of a cold entry
+	bool spilled = false;			// This listing is in the spill file as is
+	int wd = -1;					// inotify watch, if validated that way
+	uint64_t wdgen = 0;				// Watch generation at populate time
+	uint64_t wdovf = 0;				// Queue overflow count at populate time
+	
+	// fd pool state, guarded by the pool lock
+	int fd = -1;					// O_PATH|O_DIRECTORY fd or -1
+	int fdpins = 0;					// Users currently issuing *at calls on fd
+	dirent_t* fdprev = nullptr;		// LRU links
+	dirent_t* fdnext = nullptr;
+};
+
+/**
+ * What changed between two consecutive versions of a listing, see dircache_diff
+ */
+struct dc_change_t {
+	int kind;						// dircache_change_kind_t
+	std::string name;
+	unsigned char old_type, new_type;
+	ino_t old_ino, new_ino;
+};
+
+struct dc_changeset_t {
+	uint64_t from, to;				// Versions
+	std::vector<dc_change_t> changes;	// Sorted by name
+};
+
+#define DC_DIFF_HISTORY 16			// Changesets kept per listing
+
+/**
+ * On-disk layout of an offline index, see dircache_build_index.
+ * All offsets are from the start of the file. Each directory's entries
+ * are variable length dirent records (d_reclen bytes, 8 byte aligned)
+ * sorted by name, reached through a table of offsets.
+ */
+struct dc_index_header_t {
+	char magic[8];			// DC_INDEX_MAGIC
+	uint32_t version;
+	uint32_t ndirs;
+	uint64_t root_off;		// Absolute path of the indexed root
+	uint64_t dirs_off;		// dc_index_dir_t[ndirs], sorted by path
+	uint64_t size;			// Total file size
 };
 
+struct dc_index_dir_t {
+	uint64_t path_off;		// Path relative to root, "" for the root itself
+	uint64_t ents_off;		// uint64_t[nents] of record offsets
+	uint64_t nents;
+};
+
+#define DC_INDEX_MAGIC "DCINDEX"
+#define DC_INDEX_VERSION 1
+
+// First line of a hot set file. The rest are "<accesses> <path>", hottest first
+#define DC_HOTSET_MAGIC "# dircache hotset 1"
+
 /**
  * dircontext_t just contains a position in the read stream
  * and a pointer to the dirent_t that we're supposed to be 
  * reading from.
+ * Directories served from an offline index have idx set instead of ent.
+ * Each context gets its own cache line since pos is written on every
+ * readdir and contexts on different threads would otherwise share lines.
  * This is the definition of the details behind the 
  */
-struct dircontext_t {
+struct alignas(64) dircontext_t {
 	size_t pos;
 	dirent_t* ent;
+	const dc_index_dir_t* idx;
+	const char* ibase;			// Start of the mapped index idx lives in
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -91,192 +264,4685 @@ struct AutoReadLock {
 };
 
 ////////////////////////////////////////////////////////////////////////////////
-// Global db accessors
+// Epoch based reclamation
+//  Lock-free readers enter an epoch before touching shared nodes. Retired
+//  nodes are only freed once every thread that might have seen them has
+//  left the epoch it was in at retire time. Each thread owns a slot from a
+//  grow-only list until it exits, so there's one per thread ever running
+//  at once.
 ////////////////////////////////////////////////////////////////////////////////
 
-// Returns the internal directory db
-static auto& dir_db() {
-	static std::unordered_map<std::string, dirent_t*> dirdb;
-	return dirdb;
+struct alignas(64) dc_epoch_slot_t {
+	std::atomic<uint64_t> active {0};	// Epoch this thread entered, 0 if quiescent
+	std::atomic_bool owned {false};
+	dc_epoch_slot_t* next = nullptr;	// Never changes once pushed
+};
+
+struct dc_retired_t {
+	uint64_t epoch;
+	void (*fn)(void*);
+	void* ptr;
+};
+
+struct dc_epoch_t {
+	std::atomic<uint64_t> global {1};
+	std::atomic<dc_epoch_slot_t*> slots {nullptr};	// Never freed, reused by later threads
+	std::mutex lock;
+	std::vector<dc_retired_t> retired;
+};
+
+static auto& dc_epoch() {
+	static dc_epoch_t* epoch = new dc_epoch_t; // Never destroyed, threads may outlive statics
+	return *epoch;
 }
 
-// Returns global db lock
-static auto& dir_db_lock() {
-	static ReadWriteLock lock;
-	return lock;
+/**
+ * Per-thread slot ownership. Slots are handed back on thread exit
+ */
+struct dc_epoch_thread_t {
+	dc_epoch_slot_t* slot = nullptr;
+	int depth = 0;
+	
+	dc_epoch_slot_t* get() {
+		if (slot)
+			return slot;
+		auto& ep = dc_epoch();
+		for (auto* s = ep.slots.load(); s; s = s->next) {
+			bool expected = false;
+			if (!s->owned.load(std::memory_order_relaxed)
+				&& s->owned.compare_exchange_strong(expected, true))
+				return slot = s;
+		}
+		// All taken, add one
+		auto* s = new dc_epoch_slot_t;
+		s->owned.store(true);
+		s->next = ep.slots.load();
+		while (!ep.slots.compare_exchange_weak(s->next, s)) {}
+		return slot = s;
+	}
+	~dc_epoch_thread_t() {
+		if (slot)
+			slot->owned.store(false);
+	}
+};
+
+static thread_local dc_epoch_thread_t dc_epoch_thread;
+
+static void dc_epoch_enter() {
+	if (dc_epoch_thread.depth++)
+		return;
+	auto* slot = dc_epoch_thread.get();
+	slot->active.store(dc_epoch().global.load()); // seq_cst, must be visible before any reads
 }
 
-static dircontext_t* dc_build_around_ent(dirent_t* dent) {
-	auto* ctx = new dircontext_t;
-	dent->nref.fetch_add(1); // Inc ref count
-	ctx->ent = dent;
-	ctx->pos = 0;
-	return ctx;
+static void dc_epoch_exit() {
+	if (--dc_epoch_thread.depth)
+		return;
+	dc_epoch_thread.slot->active.store(0, std::memory_order_release);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Private helpers
-////////////////////////////////////////////////////////////////////////////////
+/**
+ * Auto guard for an epoch critical section
+ */
+struct AutoEpoch {
+	AutoEpoch() { dc_epoch_enter(); }
+	~AutoEpoch() { dc_epoch_exit(); }
+};
 
 /**
- * Returns time in ms
+ * Oldest epoch a thread is still in. Anything retired before it is unseen
  */
-static double dc_get_time() {
-	timespec tp;
-	clock_gettime(CLOCK_MONOTONIC, &tp);
-	return (tp.tv_sec * 1e3) + (tp.tv_nsec / 1e6);
+static uint64_t dc_epoch_min() {
+	uint64_t min = UINT64_MAX;
+	for (auto* s = dc_epoch().slots.load(); s; s = s->next) {
+		uint64_t e = s->active.load();
+		if (e && e < min)
+			min = e;
+	}
+	return min;
 }
 
-template<size_t N>
-static void dc_fix_path(const char* path, char (&dest)[N]) {
-	strncpy(dest, path, N);
-	dest[N-1] = 0;
-	char* c = dest;
-	while(*c) { c++; }
-	// Chop off any / at the end of the line
-	while(*c && *c == '/') {*c = 0;}
+/**
+ * Free whatever retired nodes no thread can still see
+ */
+static void dc_epoch_reclaim() {
+	auto& ep = dc_epoch();
+	uint64_t min = dc_epoch_min();
+	
+	std::vector<dc_retired_t> ready;
+	{
+		std::lock_guard<std::mutex> lock(ep.lock);
+		for (size_t i = 0; i < ep.retired.size();) {
+			if (ep.retired[i].epoch < min) {
+				ready.push_back(ep.retired[i]);
+				ep.retired[i] = ep.retired.back();
+				ep.retired.pop_back();
+			}
+			else
+				++i;
+		}
+	}
+	for (auto& r : ready)
+		r.fn(r.ptr);
 }
 
 /**
- * Find or populate the dir in the db
- * Calls readdir outright if the dir doesn't exist in the db yet,
- * then stores off those results.
+ * Free ptr with fn once no reader can hold it. ptr must already be unreachable
  */
-static dircontext_t* dc_find_or_populate(const char* path) {
-	// Try to get an entry
+static void dc_epoch_retire(void* ptr, void (*fn)(void*)) {
+	auto& ep = dc_epoch();
+	size_t n;
 	{
-		AutoReadLock readLock(dir_db_lock());
-		auto &db = dir_db();
-		if (auto ent = db.find((char*)path); ent != db.end()) {
-			return dc_build_around_ent(ent->second);
+		std::lock_guard<std::mutex> lock(ep.lock);
+		ep.retired.push_back({ep.global.fetch_add(1), fn, ptr});
+		n = ep.retired.size();
+	}
+	if (n >= 64)
+		dc_epoch_reclaim();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalable ref counting
+//  Hot entries have their ref count split into cache line sized shards so
+//  opens on different threads don't all bounce one line. A ref can be
+//  dropped on a different shard than it was taken on; only the sum matters,
+//  and the sum is only needed when a stale entry is purged. Shards can't be
+//  summed while they move, so a purge first freezes the entry, which sends
+//  refs to the central count, and sums once an epoch has passed.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DC_REF_SHARDS 32
+#define DC_REF_HOT 4		// Concurrent refs on the central counter before splitting
+
+struct alignas(64) dc_refshard_t {
+	std::atomic_int64_t n {0};
+};
+
+static int dc_ref_shard() {
+	static std::atomic_int next {0};
+	static thread_local int shard = next.fetch_add(1, std::memory_order_relaxed) % DC_REF_SHARDS;
+	return shard;
+}
+
+static void dc_ref(dirent_t* dent) {
+	if (auto* shards = dent->nrefshards.load(std::memory_order_acquire)) {
+		AutoEpoch epoch; // Lets a purge wait out shard updates that missed the freeze
+		if (!dent->frozen.load()) {
+			shards[dc_ref_shard()].n.fetch_add(1);
+			return;
 		}
 	}
-	
-	// read contents and store into the db.
-	dirent** namelist = nullptr;
-	// Grab all dir entries
-	int r = scandir(path, &namelist, 
-		[](const dirent* d) -> int { return 1; },
-		[](const dirent** a, const dirent** b) -> int {
-			return strcmp((*a)->d_name, (*b)->d_name);
-		});
-	// Bail out on error
-	if (r == -1) {
-		return nullptr;
+	// Many handles open at once means many threads on this entry, split it up
+	if (dent->nref.fetch_add(1) + 1 >= DC_REF_HOT && !dent->frozen.load()) {
+		auto* shards = new dc_refshard_t[DC_REF_SHARDS];
+		dc_refshard_t* expected = nullptr;
+		if (!dent->nrefshards.compare_exchange_strong(expected, shards))
+			delete[] shards;
 	}
-	
-	// Build a new directory entry
-	auto* dent = new dirent_t();
-	dent->addedat = dc_get_time();
-	dent->nref.store(0);
-	for (int i = 0; i < r; ++i)
-		dent->entries.push_back(*namelist[i]);
-	
-	// Insert into the db
-	dir_db_lock().write_lock();
-	dir_db().insert({path, dent});
-	dir_db_lock().unlock();
-	
-	for (int i = 0; i < r; ++i)
-		free(namelist[i]);
-	free(namelist);
+}
 
-	// Finally build a returnable value
-	return dc_build_around_ent(dent);
+static void dc_unref(dirent_t* dent) {
+	if (auto* shards = dent->nrefshards.load(std::memory_order_acquire)) {
+		AutoEpoch epoch;
+		if (!dent->frozen.load()) {
+			shards[dc_ref_shard()].n.fetch_sub(1);
+			return;
+		}
+	}
+	dent->nref.fetch_sub(1);
 }
 
-static void dc_close(dircontext_t* context) {
-	context->ent->nref.fetch_sub(1); // Dec refcount
-	memset(context, 0, sizeof(*context)); // For safety :)
-	
-	// @TODO: Evict stale entries
-	
-	
-	delete context;
+/**
+ * Total refs. Only exact if no shard can be updated meanwhile, as for a
+ * frozen entry once its epoch has passed. Otherwise a guess.
+ */
+static int64_t dc_refs(const dirent_t* dent) {
+	int64_t n = dent->nref.load();
+	if (auto* shards = dent->nrefshards.load()) {
+		for (int i = 0; i < DC_REF_SHARDS; ++i)
+			n += shards[i].n.load();
+	}
+	return n;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Public implementation
+// Flat hash table
+//  Open addressing with one control byte per slot, probed 16 at a time
+//  (SSE2 where available). Readers are lock-free under an epoch, writers
+//  are serialized by dir_db_lock(). Keys live in the dirent_t itself.
 ////////////////////////////////////////////////////////////////////////////////
 
-// Invalidate all entries
-void dircache_invalidate() {
-	dir_db_lock().write_lock();
-	for (auto& p : dir_db()) {
-		delete p.second;
-	}
-	dir_db().clear();
-	dir_db_lock().unlock();
+#define DC_GROUP_SIZE 16
+#define DC_CTRL_EMPTY 0x80
+#define DC_CTRL_DELETED 0xFE
+
+// Left in a slot of a table that's being rehashed or dropped. Lookups that
+// see this carry on in the table it's being rehashed into, or if it's
+// being dropped, give up.
+#define DC_SLOT_MOVED ((dirent_t*)1)
+
+struct dc_table_t {
+	size_t ngroups;					// Power of 2
+	size_t used;					// Full and deleted slots, writers only
+	size_t live;					// Full slots, writers only
+	uint8_t* ctrl;					// Control bytes, h2 of the hash or EMPTY/DELETED
+	std::atomic<dirent_t*>* slots;
+	std::atomic<dc_table_t*> next {nullptr};	// Table being rehashed into, set before any slot moves
+};
+
+static size_t dc_hash_path(std::string_view path) {
+	return std::hash<std::string_view>()(path);
 }
 
-// readdir(3)
-dirent* dircache_readdir(dircontext_t* dir) {
-	if (dir->pos >= dir->ent->entries.size())
-		return nullptr;
-	return &dir->ent->entries[dir->pos++];
+static uint8_t dc_h2(size_t hash) {
+	return hash & 0x7F;
 }
 
-// opendir(3)
-dircontext_t* dircache_opendir(const char* path) {
-	char fixed[PATH_MAX]; // Correct any bad slashes
-	dc_fix_path(path, fixed);
-	return dc_find_or_populate(fixed);
+static dc_table_t* dc_table_new(size_t ngroups) {
+	auto* t = new dc_table_t;
+	size_t n = ngroups * DC_GROUP_SIZE;
+	t->ngroups = ngroups;
+	t->used = t->live = 0;
+	t->ctrl = (uint8_t*)aligned_alloc(DC_GROUP_SIZE, n);
+	memset(t->ctrl, DC_CTRL_EMPTY, n);
+	t->slots = new std::atomic<dirent_t*>[n];
+	for (size_t i = 0; i < n; ++i)
+		t->slots[i].store(nullptr, std::memory_order_relaxed);
+	return t;
 }
 
-// rewinddir(3)
-void dircache_rewinddir(dircontext_t* dir) {
-	dir->pos = 0;
+static void dc_table_free(void* p) {
+	auto* t = (dc_table_t*)p;
+	free(t->ctrl);
+	delete[] t->slots;
+	delete t;
 }
 
-// telldir(3)
-long dircache_telldir(dircontext_t* dir) {
-	return dir->pos;
+/**
+ * Bitmask of slots in the group whose control byte equals b
+ */
+static uint32_t dc_group_match(const uint8_t* group, uint8_t b) {
+#ifdef __SSE2__
+	// Racy with writers' byte stores, a torn view only causes a retry of the slot load
+	__m128i ctrl = _mm_load_si128((const __m128i*)group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < DC_GROUP_SIZE; ++i)
+		if (__atomic_load_n(&group[i], __ATOMIC_RELAXED) == b)
+			mask |= 1u << i;
+	return mask;
+#endif
 }
 
-// seekdir(3)
-void dircache_seekdir(dircontext_t* dir, long loc) {
-	if (loc >= dir->ent->entries.size())
-		return;
-	dir->pos = loc;
+/**
+ * Lock-free lookup. Caller must be in an epoch.
+ * Follows a rehash into the new table, so never waits on one. Returns
+ * DC_SLOT_MOVED if the table is being torn down. If slot is given it's set
+ * to the slot the entry was found in.
+ */
+static dirent_t* dc_table_find(const dc_table_t* t, const char* path, size_t hash,
+	std::atomic<dirent_t*>** slot = nullptr) {
+	size_t g = (hash >> 7) & (t->ngroups - 1);
+	for (size_t i = 1; i <= t->ngroups; ++i) {
+		const uint8_t* group = t->ctrl + g * DC_GROUP_SIZE;
+		uint32_t match = dc_group_match(group, dc_h2(hash));
+		uint32_t empty = dc_group_match(group, DC_CTRL_EMPTY);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		while (match) {
+			size_t idx = g * DC_GROUP_SIZE + __builtin_ctz(match);
+			auto* dent = t->slots[idx].load(std::memory_order_acquire);
+			if (dent == DC_SLOT_MOVED) {
+				// Everything here was copied over before its slot was frozen
+				auto* nt = t->next.load(std::memory_order_acquire);
+				return nt ? dc_table_find(nt, path, hash, slot) : dent;
+			}
+			if (dent && dent->hash == hash && dent->path == path) {
+				if (slot)
+					*slot = &t->slots[idx];
+				return dent;
+			}
+			match &= match - 1;
+		}
+		if (empty)
+			return nullptr;
+		g = (g + i) & (t->ngroups - 1); // Triangular probing visits every group
+	}
+	return nullptr;
 }
 
-// closedir(3)
-void dircache_closedir(dircontext_t* dir) {
-	dc_close(dir);
+/**
+ * Returns the slot holding path, or -1. Writers only
+ */
+static ssize_t dc_table_find_slot(const dc_table_t* t, const char* path, size_t hash) {
+	size_t g = (hash >> 7) & (t->ngroups - 1);
+	for (size_t i = 1; i <= t->ngroups; ++i) {
+		const uint8_t* group = t->ctrl + g * DC_GROUP_SIZE;
+		uint32_t match = dc_group_match(group, dc_h2(hash));
+		while (match) {
+			size_t idx = g * DC_GROUP_SIZE + __builtin_ctz(match);
+			auto* dent = t->slots[idx].load(std::memory_order_relaxed);
+			if (dent && dent->hash == hash && dent->path == path)
+				return idx;
+			match &= match - 1;
+		}
+		if (dc_group_match(group, DC_CTRL_EMPTY))
+			return -1;
+		g = (g + i) & (t->ngroups - 1);
+	}
+	return -1;
 }
 
-// scandir(3)
-int dircache_scandir(const char* dirp,
-	struct dirent*** namelist,
-	int (*filter)(const struct dirent*),
-	int (*compare)(const struct dirent**,
-		const struct dirent**)) {
-	
-	auto ctx = dc_find_or_populate(dirp);
-	if (!ctx)
-		return -1;
-		
-	// Accumulate entries into a list -- This is not quite optimal. Should determine the number of ents first
-	*namelist = (dirent**)calloc(ctx->ent->entries.size(), sizeof(dirent*));
-	int n = 0;
-	for (auto& e : ctx->ent->entries) {
-		if (filter && filter(&e))
+/**
+ * Put dent into the first free slot on its probe sequence. Writers only,
+ * dent must not already be present and the table must have room.
+ */
+static size_t dc_table_place(dc_table_t* t, dirent_t* dent) {
+	size_t g = (dent->hash >> 7) & (t->ngroups - 1);
+	for (size_t i = 1;; ++i) {
+		uint8_t* group = t->ctrl + g * DC_GROUP_SIZE;
+		uint32_t free = dc_group_match(group, DC_CTRL_EMPTY) | dc_group_match(group, DC_CTRL_DELETED);
+		if (free) {
+			size_t idx = g * DC_GROUP_SIZE + __builtin_ctz(free);
+			if (t->ctrl[idx] == DC_CTRL_EMPTY)
+				t->used++;
+			t->live++;
+			// Slot first, so a reader that sees the control byte sees the entry
+			t->slots[idx].store(dent, std::memory_order_release);
+			__atomic_store_n(&t->ctrl[idx], dc_h2(dent->hash), __ATOMIC_RELEASE);
+			return idx;
+		}
+		g = (g + i) & (t->ngroups - 1);
+	}
+}
+
+/**
+ * Move live entries into a new table sized for them. Writers only.
+ * Each entry is copied before its old slot is frozen with DC_SLOT_MOVED, so
+ * lookups that run into a frozen slot find it in the new table, and
+ * lock-free replacements can't land in the old table after the fact.
+ */
+static dc_table_t* dc_table_rehash(dc_table_t* t) {
+	size_t ngroups = t->ngroups;
+	// Grow if mostly live, otherwise we're just clearing out tombstones
+	if ((t->live + 1) * 2 > ngroups * DC_GROUP_SIZE)
+		ngroups *= 2;
+	auto* nt = dc_table_new(ngroups);
+	t->next.store(nt, std::memory_order_release);
+	for (size_t i = 0; i < t->ngroups * DC_GROUP_SIZE; ++i) {
+		// Only lock-free replacements can race with us, and those keep the slot full
+		auto* dent = t->slots[i].load(std::memory_order_acquire);
+		if (!dent) {
+			t->slots[i].store(DC_SLOT_MOVED, std::memory_order_release);
 			continue;
-	#ifdef DIRCACHE_DROPIN
-		auto* p = malloc(sizeof(dirent));
-		memcpy(p, &e, sizeof(dirent));
-		(*namelist)[n++] = (dirent*)p;
-	#else
-		(*namelist)[n++] = &e;
-	#endif
+		}
+		size_t idx = dc_table_place(nt, dent);
+		while (!t->slots[i].compare_exchange_strong(dent, DC_SLOT_MOVED))
+			nt->slots[idx].store(dent, std::memory_order_release); // Replaced meanwhile, same path
 	}
+	return nt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Cache instances and db accessors
+//  Everything a cache owns lives in its dircache_t: the table and its
+//  writer lock, generation, fd pool and budget, stale list and policies.
+//  The plain dircache_ functions use a default instance.
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * LRU list of pooled directory fds, see the fd pool section
+ */
+struct dc_fd_pool_t {
+	std::mutex lock;
+	dirent_t* head = nullptr;	// Most recently used
+	dirent_t* tail = nullptr;	// Least recently used
+	int count = 0;
+};
+
+/**
+ * Entries replaced in the db, freed once unreferenced
+ */
+struct dc_stale_list_t {
+	std::mutex lock;
+	std::vector<dirent_t*> ents;
+};
+
+/**
+ * Per-filesystem policies and the mounts they've been applied to
+ */
+struct dc_policy_table_t {
+	std::mutex lock;
+	std::unordered_map<long, dircache_policy_t> policies;	// f_type -> policy, 0 is the fallback
+	std::unordered_map<dev_t, dc_mount_t*> mounts;
+};
+
+/**
+ * A directory load other threads are waiting on
+ */
+struct dc_flight_t {
+	std::condition_variable cv;		// Waits on the cache's flightlock
+	bool done = false;
+	int err = 0;					// errno of a failed load
+	int users = 1;					// Loader plus waiters
+	dirent_t* dent = nullptr;		// Listing that wasn't admitted, referenced once per waiter
+};
+
+/**
+ * Child prefetch settings and its hit ratio bookkeeping
+ */
+struct dc_prefetch_t {
+	std::atomic_int enabled {0};
+	std::atomic_int max_fanout {32};
+	std::atomic_int max_depth {1};
+	std::atomic_int max_queued {256};
+	std::atomic<double> min_hit_ratio {0.25};
 	
-	// Resultant list sorted with qsort, as specified by POSIX standard
-	if (n && compare)
-		qsort(*namelist, n, sizeof(dirent*), (comparison_fn_t)compare);
+	std::atomic_int queued {0};				// Waiting or running
+	std::atomic<uint64_t> issued {0};		// Totals, for stats
+	std::atomic<uint64_t> hits {0};
+	std::atomic<uint64_t> win_issued {0};	// Current window, to judge the hit ratio
+	std::atomic<uint64_t> win_hits {0};
+	std::atomic<uint64_t> off_until {0};	// Paused until this many demand populates
+};
+
+/**
+ * Directory open transitions, for trace prefetch. Direct mapped rows keyed
+ * by the hash of the directory opened first, each with a few of the
+ * directories most often opened next by the same thread.
+ */
+#define DC_TRACE_ROWS 1024
+#define DC_TRACE_WAYS 4
+#define DC_TRACE_STRIPES 64
+
+struct dc_trace_next_t {
+	size_t hash = 0;
+	uint32_t count = 0;
+	std::string path;
+};
+
+struct dc_trace_row_t {
+	size_t from = 0;
+	dc_trace_next_t next[DC_TRACE_WAYS];
+};
+
+struct dc_trace_t {
+	std::atomic_int enabled {0};
+	std::atomic<dc_trace_row_t*> rows {nullptr};	// DC_TRACE_ROWS, allocated on first enable
+	std::mutex locks[DC_TRACE_STRIPES];				// Row i is guarded by locks[i % DC_TRACE_STRIPES]
+	std::atomic<uint64_t> issued {0};
+	std::atomic<uint64_t> hits {0};
+};
+
+/**
+ * A memoized union view, see dircache_open_union
+ */
+struct dc_union_t {
+	dirent_t* dent;					// Merged listing, the memo holds a reference
+	std::vector<uint64_t> versions;	// Versions of the constituents it was built from, 0 if missing
+};
+
+/**
+ * A registered search path and its name -> first directory table,
+ * see dircache_add_search_path
+ */
+#define DC_MAX_SEARCH_PATHS 64
+
+struct dc_search_path_t {
+	ReadWriteLock lock;							// Readers resolve, writers apply listing changes
+	std::vector<std::string> dirs;
+	std::vector<dirent_t*> dents;				// Listing each answer came from, referenced. null if missing
+	std::unordered_set<std::string> names;		// Backing store for the keys of first
+	std::unordered_map<std::string_view, int> first;	// Name -> index of the first dir that has it
+	std::atomic<double> checked_at {0};			// When the members were last revalidated
+	std::atomic<double> recheck_ms {-1};		// Shortest TTL among them, -1 if none expire
+	std::atomic<uint64_t> gen {0};				// Cache generation they were revalidated in
+};
+
+/**
+ * Where an evicted listing was spilled, and what's needed to bring it back
+ * as if it had stayed cached
+ */
+struct dc_spill_rec_t {
+	int seg;
+	uint64_t off;
+	uint32_t len;
+	uint64_t gen;
+	double addedat;
+	struct stat st;
+	dc_mount_t* mount;
+	uint64_t accesses;
+};
+
+/**
+ * An append-only spill file. Unlinked as soon as it's made
+ */
+struct dc_spill_seg_t {
+	int fd;
+	uint64_t size;					// Bytes appended
+	uint64_t live;					// ... still referenced by the index
+};
+
+/**
+ * Spill files of a cache, see dircache_set_spill_dir. Only the reclaimer
+ * appends, holding writelock, then publishes records under lock
+ */
+struct dc_spill_t {
+	std::mutex writelock;						// Appends and setup
+	ReadWriteLock lock;							// Index and segment list
+	std::atomic_bool enabled {false};
+	std::string dir;
+	std::map<int, dc_spill_seg_t> segs;
+	int active = -1;							// Segment being appended to
+	int nextseg = 0;
+	uint64_t gen = 0;							// Generation of the records in index
+	std::unordered_map<std::string, dc_spill_rec_t> index;	// Path -> latest spilled listing
+	std::atomic<uint64_t> writes {0};
+	std::atomic<uint64_t> hits {0};
+};
+
+/**
+ * Count-min sketch of lookup frequencies, see dircache_set_admission.
+ * DC_SKETCH_ROWS rows of saturating counters
+ */
+#define DC_SKETCH_ROWS 4
+#define DC_SKETCH_MAX 15				// Counters saturate here, like 4 bit ones
+#define DC_SKETCH_MIN_WIDTH 1024
+
+struct dc_sketch_t {
+	size_t mask;						// Row width - 1
+	std::atomic<uint64_t> samples {0};	// Lookups since counts were last halved
+	std::atomic_uint8_t* counts;		// Row after row
+};
+
+struct dircache_t {
+	std::atomic<dc_table_t*> db;
+	ReadWriteLock db_lock;
+	std::atomic<uint64_t> generation {1};
+	std::atomic_bool sweep {false};		// A generation bump needs sweeping
+	std::atomic_int fd_budget;			// Max pooled directory fds
+	dc_fd_pool_t fdpool;
+	dc_stale_list_t stale;
+	dc_policy_table_t policies;
 	
-	dc_close(ctx);
-	return n;
+	std::atomic_int max_populates;		// Concurrent directory reads, 0 for unlimited
+	dc_admission_t admit;
+	std::mutex flightlock;
+	std::unordered_map<std::string, dc_flight_t*> flights;	// Path -> load in progress
+	
+	std::atomic_int nbackground {0};	// Queued or running background work
+	std::atomic_int timed_loaders {0};	// dc_acquire_timeout threads still running
+	std::atomic_bool destroying {false};
+	std::atomic_bool torn_down {false};	// Claimed by whoever frees it
+	
+	std::atomic<uint64_t> populates {0};	// Directories read on demand
+	dc_prefetch_t prefetch;
+	dc_trace_t trace;
+	
+	std::mutex unionlock;
+	std::unordered_map<std::string, dc_union_t> unions;	// Mode and paths -> memo
+	
+	std::mutex searchlock;					// Registration and change notification
+	std::atomic<dc_search_path_t*> searchpaths[DC_MAX_SEARCH_PATHS] {};
+	std::atomic_int nsearchpaths {0};
+	std::unordered_map<std::string, std::vector<std::pair<int, int>>> searchdirs; // Dir -> (search path, index)
+	
+	std::mutex snaplock;					// Snapshot registry and dirent_t::prev links
+	std::atomic_int nsnapshots {0};
+	std::multiset<uint64_t> snapversions;	// Versions active snapshots were taken at
+	
+	std::atomic<double> cold_after_ms {0};	// Idle time before a listing is packed, 0 never
+	double coldscan = 0;					// When the reclaimer last looked for idle listings
+	std::atomic<uint64_t> packs {0};		// Listings packed
+	std::atomic<uint64_t> thaws {0};		// ... and unpacked again by a lookup
+	
+	std::atomic<size_t> mem_budget {0};		// Bytes of listings to keep, 0 for unlimited
+	double evictscan = 0;					// When the reclaimer last checked the budget
+	std::atomic<uint64_t> evictions {0};
+	dc_spill_t spill;
+	
+	std::atomic_bool admission {false};		// Filter new listings by frequency near the budget
+	std::atomic<dc_sketch_t*> sketch {nullptr};
+	std::atomic_int admit_over {-1};		// Frequency a new listing has to beat, -1 admits all
+	std::atomic<uint64_t> rejects {0};		// Listings read but not admitted
+};
+
+/**
+ * A consistent view across directories, see dircache_snapshot_begin
+ */
+struct dircache_snapshot_t {
+	dircache_t* cache;
+	uint64_t version;				// Listings published after this are too new
+	std::mutex lock;
+	std::unordered_map<std::string, dirent_t*> pinned;	// Path -> listing this snapshot sees, referenced
+};
+
+// Returns the internal directory db
+static auto& dir_db(dircache_t* cache) {
+	return cache->db;
+}
+
+// Returns the db lock. Only writers take this, readers go through an epoch
+static auto& dir_db_lock(dircache_t* cache) {
+	return cache->db_lock;
+}
+
+static dircontext_t* dc_build_around_ent(dirent_t* dent) {
+	auto* ctx = new dircontext_t;
+	dc_ref(dent); // Inc ref count
+	ctx->ent = dent;
+	ctx->idx = nullptr;
+	ctx->ibase = nullptr;
+	ctx->pos = 0;
+	return ctx;
+}
+
+static size_t dc_ctx_size(const dircontext_t* ctx) {
+	return ctx->ent ? ctx->ent->entries.size() : ctx->idx->nents;
+}
+
+static dirent* dc_ctx_at(dircontext_t* ctx, size_t i) {
+	if (ctx->ent)
+		return &ctx->ent->entries[i];
+	auto* offs = (const uint64_t*)(ctx->ibase + ctx->idx->ents_off);
+	return (dirent*)(ctx->ibase + offs[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Directory fd pool
+//  Keeps O_PATH fds open on recently used directories, capped by the
+//  fd budget. Least recently used unpinned fds are closed first.
+////////////////////////////////////////////////////////////////////////////////
+
+static void dc_fd_unlink(dc_fd_pool_t& pool, dirent_t* dent) {
+	if (dent->fdprev) dent->fdprev->fdnext = dent->fdnext;
+	else pool.head = dent->fdnext;
+	if (dent->fdnext) dent->fdnext->fdprev = dent->fdprev;
+	else pool.tail = dent->fdprev;
+	dent->fdprev = dent->fdnext = nullptr;
+}
+
+static void dc_fd_push_front(dc_fd_pool_t& pool, dirent_t* dent) {
+	dent->fdprev = nullptr;
+	dent->fdnext = pool.head;
+	if (pool.head) pool.head->fdprev = dent;
+	pool.head = dent;
+	if (!pool.tail) pool.tail = dent;
+}
+
+/**
+ * Close LRU fds until we're within budget. Pinned fds are skipped
+ */
+static void dc_fd_trim(dircache_t* cache) {
+	auto& pool = cache->fdpool;
+	int budget = cache->fd_budget.load(std::memory_order_relaxed);
+	for (auto* d = pool.tail; d && pool.count > budget;) {
+		auto* prev = d->fdprev;
+		if (!d->fdpins) {
+			dc_fd_unlink(pool, d);
+			close(d->fd);
+			d->fd = -1;
+			pool.count--;
+		}
+		d = prev;
+	}
+}
+
+/**
+ * Returns a pinned fd for dent, opening one by path if needed.
+ * Returns -1 if the directory couldn't be opened.
+ * Must be paired with dc_fd_unpin
+ */
+static int dc_fd_pin(dirent_t* dent) {
+	auto& pool = dent->cache->fdpool;
+	{
+		std::lock_guard<std::mutex> lock(pool.lock);
+		if (dent->fd >= 0) {
+			dent->fdpins++;
+			dc_fd_unlink(pool, dent);
+			dc_fd_push_front(pool, dent);
+			return dent->fd;
+		}
+	}
+	
+	int fd = open(dent->path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	
+	std::lock_guard<std::mutex> lock(pool.lock);
+	if (dent->fd >= 0) {
+		// Lost a race with another opener
+		close(fd);
+	}
+	else {
+		dent->fd = fd;
+		dc_fd_push_front(pool, dent);
+		pool.count++;
+	}
+	dent->fdpins++;
+	return dent->fd;
+}
+
+static void dc_fd_unpin(dirent_t* dent) {
+	auto& pool = dent->cache->fdpool;
+	std::lock_guard<std::mutex> lock(pool.lock);
+	dent->fdpins--;
+	dc_fd_trim(dent->cache);
+}
+
+/**
+ * Hand an already open O_PATH fd over to the pool
+ */
+static void dc_fd_adopt(dirent_t* dent, int fd) {
+	auto& pool = dent->cache->fdpool;
+	std::lock_guard<std::mutex> lock(pool.lock);
+	dent->fd = fd;
+	dc_fd_push_front(pool, dent);
+	pool.count++;
+	dc_fd_trim(dent->cache);
+}
+
+/**
+ * Close dent's pooled fd, unless someone has it pinned
+ */
+static void dc_fd_drop(dirent_t* dent) {
+	auto& pool = dent->cache->fdpool;
+	std::lock_guard<std::mutex> lock(pool.lock);
+	if (dent->fd < 0 || dent->fdpins)
+		return;
+	dc_fd_unlink(pool, dent);
+	close(dent->fd);
+	dent->fd = -1;
+	pool.count--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Stale entry list
+//  Entries replaced in the db live here until their last context is closed
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Frees just the memory of an entry, which must no longer hold a pooled fd
+ */
+static void dc_free_ent_deferred(void* p) {
+	auto* dent = (dirent_t*)p;
+	delete[] dent->nrefshards.load();
+	delete dent->columns.load();
+	delete dent;
+}
+
+static void dc_inotify_unwatch(dirent_t* dent);
+
+static void dc_free_ent(dirent_t* dent) {
+	dc_fd_drop(dent);
+	dc_inotify_unwatch(dent);
+	dc_free_ent_deferred(dent);
+}
+
+/**
+ * Mark an entry that has already been removed from the db as stale.
+ * No new references can be taken on it after this point
+ */
+static void dc_retire(dirent_t* dent) {
+	dent->stale.store(true);
+	auto& list = dent->cache->stale;
+	std::lock_guard<std::mutex> lock(list.lock);
+	list.ents.push_back(dent);
+}
+
+static void dc_release(dirent_t* dent);
+static void dc_reclaim_kick(dircache_t* cache, bool sweep);
+
+/**
+ * Free stale entries that have no more references. Returns how many were freed.
+ * Split entries are frozen the first time around and summed once the epoch
+ * they were frozen in has passed, unless the cache is known quiescent.
+ */
+static size_t dc_purge_stale(dircache_t* cache, bool quiescent = false) {
+	auto& list = cache->stale;
+	std::lock_guard<std::mutex> lock(list.lock);
+	uint64_t min = dc_epoch_min();
+	bool waiting = false;
+	size_t freed = 0;
+	for (size_t i = 0; i < list.ents.size();) {
+		auto* dent = list.ents[i];
+		bool fresh = false;
+		// Never split means nobody can be updating a shard, so no need to wait
+		if (!dent->frozen.exchange(true) && dent->nrefshards.load()) {
+			dent->frozeat = dc_epoch().global.fetch_add(1);
+			fresh = true; // min was taken before, so wait for the next pass
+		}
+		if (!quiescent && (fresh || dent->frozeat >= min)) {
+			waiting = true;
+			++i;
+			continue;
+		}
+		if (dc_refs(list.ents[i]) == 0) {
+			// Lock-free readers may still be looking at it. They won't touch
+			// the fd or older versions though, so those can go now while the
+			// cache is known alive
+			dc_fd_drop(list.ents[i]);
+			dc_inotify_unwatch(list.ents[i]);
+			dirent_t* prev;
+			{
+				std::lock_guard<std::mutex> snaplock(cache->snaplock); // A trim may still be walking it
+				prev = std::exchange(list.ents[i]->prev, nullptr);
+			}
+			if (prev)
+				dc_release(prev);
+			dc_epoch_retire(list.ents[i], dc_free_ent_deferred);
+			freed++;
+			list.ents[i] = list.ents.back();
+			list.ents.pop_back();
+		}
+		else
+			++i;
+	}
+	if (waiting)
+		dc_reclaim_kick(cache, false); // Look again next tick
+	return freed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Generations and background reclaim
+//  Invalidation just bumps the generation. Entries from older generations
+//  are reloaded when next looked up, and a background thread sweeps the rest
+//  out of the table and frees stale entries once their last ref is gone.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DC_SWEEP_CHUNK 1024		// Slots swept per hold of the writer lock
+#define DC_RECLAIM_MS 100		// How often the reclaimer looks for unreferenced stale entries
+
+/**
+ * One reclaimer thread serves every cache instance
+ */
+struct dc_reclaimer_t {
+	std::mutex lock;
+	std::condition_variable cv;
+	bool sweep = false;					// Some cache needs sweeping
+	std::atomic_bool pending {false};	// A stale entry may have hit zero refs
+	std::once_flag started;
+	
+	std::mutex reglock;					// Held for a whole pass, so destroy waits for it
+	std::vector<dircache_t*> caches;
+	std::atomic<double> now {0};		// Coarse clock, updated every pass
+};
+
+static auto& dc_reclaimer() {
+	static dc_reclaimer_t* r = new dc_reclaimer_t;
+	return *r;
+}
+
+/**
+ * Remove entries from older generations from the table, a chunk at a time
+ * so inserts aren't held up for long. Lookups never wait on this.
+ */
+static void dc_sweep_generation(dircache_t* cache) {
+	uint64_t gen = cache->generation.load();
+	std::vector<dirent_t*> dead;
+	for (size_t pos = 0;; pos += DC_SWEEP_CHUNK) {
+		dir_db_lock(cache).write_lock();
+		auto* t = dir_db(cache).load(std::memory_order_relaxed);
+		size_t n = t->ngroups * DC_GROUP_SIZE;
+		for (size_t i = pos; i < n && i < pos + DC_SWEEP_CHUNK; ++i) {
+			auto* dent = t->slots[i].load(std::memory_order_acquire);
+			if (!dent || dent == DC_SLOT_MOVED || dent->gen >= gen)
+				continue;
+			// CAS so a concurrent refresh of this slot wins
+			if (t->slots[i].compare_exchange_strong(dent, nullptr)) {
+				__atomic_store_n(&t->ctrl[i], DC_CTRL_DELETED, __ATOMIC_RELEASE);
+				t->live--;
+				dead.push_back(dent);
+			}
+		}
+		dir_db_lock(cache).unlock();
+		
+		for (auto* dent : dead)
+			dc_retire(dent);
+		dead.clear();
+		if (pos + DC_SWEEP_CHUNK >= n)
+			break;
+	}
+}
+
+static double dc_get_time();
+static size_t dc_pack_idle(dircache_t* cache);
+static size_t dc_evict_over_budget(dircache_t* cache);
+static void dc_sketch_age(dircache_t* cache);
+
+static void dc_reclaimer_main() {
+	auto& r = dc_reclaimer();
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(r.lock);
+			r.cv.wait_for(lock, std::chrono::milliseconds(DC_RECLAIM_MS), [&r] { return r.sweep; });
+			r.sweep = false;
+		}
+		r.now.store(dc_get_time(), std::memory_order_relaxed);
+		bool purge = r.pending.exchange(false);
+		{
+			std::lock_guard<std::mutex> lock(r.reglock);
+			for (auto* cache : r.caches) {
+				bool sweep = cache->sweep.exchange(false);
+				if (sweep)
+					dc_sweep_generation(cache);
+				dc_sketch_age(cache);
+				bool evicted = dc_evict_over_budget(cache) != 0;
+				bool packed = dc_pack_idle(cache) != 0;
+				if (sweep || purge || evicted || packed)
+					dc_purge_stale(cache);
+			}
+		}
+		dc_epoch_reclaim();
+	}
+}
+
+/**
+ * Let the reclaimer know there's work. Only wakes it for a sweep of cache,
+ * freeing stale entries waits for its next tick so closes stay cheap.
+ */
+static void dc_reclaim_kick(dircache_t* cache, bool sweep) {
+	auto& r = dc_reclaimer();
+	std::call_once(r.started, [] { std::thread(dc_reclaimer_main).detach(); });
+	if (!sweep) {
+		r.pending.store(true, std::memory_order_relaxed);
+		return;
+	}
+	cache->sweep.store(true);
+	{
+		std::lock_guard<std::mutex> lock(r.lock);
+		r.sweep = true;
+	}
+	r.cv.notify_one();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Background workers
+//  Small shared pools for work callers shouldn't wait on, like refreshing
+//  expired entries. Prefetches get a pool of their own, so directories no
+//  one asked for that hang on a slow mount can't hold up refreshes. Work
+//  counts against its cache until done, so dircache_destroy can wait it out.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DC_WORKERS 4
+#define DC_PREFETCHERS 2
+
+struct dc_workers_t {
+	std::mutex lock;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> queue;
+	std::once_flag started;
+	int nthreads;
+	
+	explicit dc_workers_t(int n) : nthreads(n) {}
+};
+
+static auto& dc_workers() {
+	static dc_workers_t* w = new dc_workers_t(DC_WORKERS); // Detached workers may outlive statics
+	return *w;
+}
+
+static auto& dc_prefetchers() {
+	static dc_workers_t* w = new dc_workers_t(DC_PREFETCHERS);
+	return *w;
+}
+
+static void dc_worker_main(dc_workers_t* pool) {
+	auto& w = *pool;
+	for (;;) {
+		std::function<void()> fn;
+		{
+			std::unique_lock<std::mutex> lock(w.lock);
+			w.cv.wait(lock, [&w] { return !w.queue.empty(); });
+			fn = std::move(w.queue.front());
+			w.queue.pop_front();
+		}
+		fn();
+	}
+}
+
+static void dc_work_submit(dircache_t* cache, std::function<void()> fn, dc_workers_t& w = dc_workers()) {
+	std::call_once(w.started, [&w] {
+		for (int i = 0; i < w.nthreads; ++i)
+			std::thread(dc_worker_main, &w).detach();
+	});
+	cache->nbackground++;
+	{
+		std::lock_guard<std::mutex> lock(w.lock);
+		w.queue.push_back([cache, fn = std::move(fn)] {
+			fn();
+			cache->nbackground--;
+		});
+	}
+	w.cv.notify_one();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private helpers
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Returns time in ms
+ */
+static double dc_get_time() {
+	timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (tp.tv_sec * 1e3) + (tp.tv_nsec / 1e6);
+}
+
+template<size_t N>
+static void dc_fix_path(const char* path, char (&dest)[N]) {
+	strncpy(dest, path, N);
+	dest[N-1] = 0;
+	char* c = dest;
+	while(*c) { c++; }
+	// Chop off any / at the end of the line, but leave a lone root alone
+	while(c > dest + 1 && *(c-1) == '/') {*--c = 0;}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Per-filesystem policy
+//  Policies are looked up by statfs f_type the first time a mount is seen
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Built in policies every new cache starts out with
+ */
+static void dc_policy_defaults(dc_policy_table_t& t) {
+	// Fallback: never expire, same as the cache always did
+	t.policies[0] = {0, DIRCACHE_VALIDATE_NONE, 1, 0, 0};
+	// Cheap to read, so always check the mtime
+	t.policies[TMPFS_MAGIC] = {0, DIRCACHE_VALIDATE_STAT, 0, 0, 0};
+	// Local disk filesystems get change notifications and report d_type
+	t.policies[EXT4_SUPER_MAGIC] = {1000, DIRCACHE_VALIDATE_INOTIFY, 0, 0, 0};
+	t.policies[XFS_SUPER_MAGIC] = {1000, DIRCACHE_VALIDATE_INOTIFY, 0, 0, 0};
+	t.policies[BTRFS_SUPER_MAGIC] = {1000, DIRCACHE_VALIDATE_INOTIFY, 0, 0, 0};
+	// Remote/userspace filesystems are slow to list and may stall
+	t.policies[NFS_SUPER_MAGIC] = {30000, DIRCACHE_VALIDATE_STAT, 1, 4, 0};
+	t.policies[FUSE_SUPER_MAGIC] = {5000, DIRCACHE_VALIDATE_STAT, 1, 2, 0};
+}
+
+static void dc_admit_retry(dc_admission_t& adm, const std::atomic_int& max);
+
+static void dc_mount_apply(dc_mount_t* mount, const dircache_policy_t& policy) {
+	mount->ttl_ms.store(policy.ttl_ms);
+	mount->validate.store(policy.validate);
+	mount->stat_prefetch.store(policy.stat_prefetch);
+	mount->max_concurrent.store(policy.max_concurrent);
+	mount->max_stale_ms.store(policy.max_stale_ms);
+	dc_admit_retry(mount->admit, mount->max_concurrent); // Limit may have been raised
+}
+
+/**
+ * Returns the mount for the directory with stat st, open at fd.
+ * Unknown mounts are identified with fstatfs.
+ */
+static dc_mount_t* dc_mount_for(dircache_t* cache, int fd, const struct stat& st) {
+	auto& table = cache->policies;
+	{
+		std::lock_guard<std::mutex> lock(table.lock);
+		if (auto it = table.mounts.find(st.st_dev); it != table.mounts.end())
+			return it->second;
+	}
+	
+	struct statfs sfs;
+	long ftype = fstatfs(fd, &sfs) == 0 ? (long)sfs.f_type : 0;
+	
+	std::lock_guard<std::mutex> lock(table.lock);
+	auto [it, inserted] = table.mounts.insert({st.st_dev, nullptr});
+	if (inserted) {
+		auto* mount = new dc_mount_t;
+		mount->dev = st.st_dev;
+		mount->ftype = ftype;
+		auto pol = table.policies.find(ftype);
+		dc_mount_apply(mount, pol != table.policies.end() ? pol->second : table.policies[0]);
+		it->second = mount;
+	}
+	return it->second;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Populate admission and coalescing
+//  Directory reads are admitted first by their mount's limit, then by the
+//  cache wide one. Concurrent misses on the same path share one load.
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Admit waiters from the head of the queue while there's room. Caller holds adm.lock,
+ * which also keeps each waiter's cv alive until it's been notified.
+ */
+static void dc_admit_wake(dc_admission_t& adm, const std::atomic_int& max) {
+	int n = max.load();
+	while (!adm.queue.empty() && (n <= 0 || adm.running < n)) {
+		auto* w = adm.queue.front();
+		adm.queue.pop_front();
+		adm.running++;
+		w->admitted = true;
+		w->cv.notify_one();
+	}
+}
+
+/**
+ * Block until there's room under max and everyone queued before us is in. max <= 0 is unlimited
+ */
+static void dc_admit(dc_admission_t& adm, const std::atomic_int& max) {
+	std::unique_lock<std::mutex> lock(adm.lock);
+	int n = max.load();
+	if (adm.queue.empty() && (n <= 0 || adm.running < n)) {
+		adm.running++;
+		return;
+	}
+	dc_admit_waiter_t w;
+	adm.queue.push_back(&w);
+	w.cv.wait(lock, [&] { return w.admitted; });
+}
+
+static void dc_admit_leave(dc_admission_t& adm, const std::atomic_int& max) {
+	std::lock_guard<std::mutex> lock(adm.lock);
+	adm.running--;
+	dc_admit_wake(adm, max); // Only the head of the line gets through
+}
+
+/**
+ * Admit any waiters a raised max has made room for
+ */
+static void dc_admit_retry(dc_admission_t& adm, const std::atomic_int& max) {
+	std::lock_guard<std::mutex> lock(adm.lock);
+	dc_admit_wake(adm, max);
+}
+
+/**
+ * Block until both the mount and the cache have room for another populate.
+ * The mount goes first so a slow mount can't hold cache wide slots while queued.
+ */
+static void dc_populate_enter(dircache_t* cache, dc_mount_t* mount) {
+	dc_admit(mount->admit, mount->max_concurrent);
+	dc_admit(cache->admit, cache->max_populates);
+}
+
+static void dc_populate_leave(dircache_t* cache, dc_mount_t* mount) {
+	dc_admit_leave(cache->admit, cache->max_populates);
+	dc_admit_leave(mount->admit, mount->max_concurrent);
+}
+
+/**
+ * Join the load of path already in flight, or start one.
+ * Returns nullptr if the caller is now loading it and must call
+ * dc_flight_finish, otherwise the flight to pass to dc_flight_wait.
+ */
+static dc_flight_t* dc_flight_join(dircache_t* cache, const char* path) {
+	std::lock_guard<std::mutex> lock(cache->flightlock);
+	auto [it, inserted] = cache->flights.insert({path, nullptr});
+	if (inserted) {
+		it->second = new dc_flight_t;
+		return nullptr;
+	}
+	it->second->users++;
+	return it->second;
+}
+
+/**
+ * Join the load of path already in flight, if there is one
+ */
+static dc_flight_t* dc_flight_find(dircache_t* cache, const char* path) {
+	std::lock_guard<std::mutex> lock(cache->flightlock);
+	auto it = cache->flights.find(path);
+	if (it == cache->flights.end())
+		return nullptr;
+	it->second->users++;
+	return it->second;
+}
+
+/**
+ * Leave a joined flight, with its result if it landed. A listing the loader
+ * couldn't put in the db is handed over in dent, referenced, or released
+ * if dent is null.
+ */
+static void dc_flight_leave(dc_flight_t* f, std::unique_lock<std::mutex>& lock, int* err, dirent_t** dent) {
+	dirent_t* handed = nullptr;
+	if (f->done) {
+		*err = f->err;
+		handed = f->dent;
+	}
+	if (--f->users == 0)
+		delete f;
+	lock.unlock();
+	if (dent)
+		*dent = handed;
+	else if (handed)
+		dc_release(handed);
+}
+
+/**
+ * Wait up to ms for a joined flight to land. Returns false if it didn't,
+ * otherwise true with the loader's errno in err. dent is as for dc_flight_leave
+ */
+static bool dc_flight_wait_for(dircache_t* cache, dc_flight_t* f, double ms, int* err,
+	dirent_t** dent = nullptr) {
+	std::unique_lock<std::mutex> lock(cache->flightlock);
+	bool landed = f->cv.wait_for(lock, std::chrono::duration<double, std::milli>(ms), [f] { return f->done; });
+	dc_flight_leave(f, lock, err, dent);
+	return landed;
+}
+
+/**
+ * Wait for a joined flight to land. Returns the loader's errno, 0 on success.
+ * dent is as for dc_flight_leave
+ */
+static int dc_flight_wait(dircache_t* cache, dc_flight_t* f, dirent_t** dent = nullptr) {
+	std::unique_lock<std::mutex> lock(cache->flightlock);
+	f->cv.wait(lock, [f] { return f->done; });
+	int err = 0;
+	dc_flight_leave(f, lock, &err, dent);
+	return err;
+}
+
+/**
+ * Land the flight for path. A listing that isn't in the db, and so can't be
+ * looked up after, is passed as unlisted and each waiter gets a ref to it
+ */
+static void dc_flight_finish(dircache_t* cache, const char* path, int err, dirent_t* unlisted = nullptr) {
+	std::lock_guard<std::mutex> lock(cache->flightlock);
+	auto it = cache->flights.find(path);
+	auto* f = it->second;
+	cache->flights.erase(it);
+	f->done = true;
+	f->err = err;
+	if (unlisted) {
+		f->dent = unlisted;
+		for (int i = 1; i < f->users; ++i)
+			dc_ref(unlisted);
+	}
+	f->cv.notify_all();
+	if (--f->users == 0)
+		delete f;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// inotify validation
+//  One non-blocking inotify fd for the process. Each watch descriptor has a
+//  generation that is bumped whenever an event arrives for it; an entry is
+//  changed if the generation moved since it was populated. Watches are
+//  shared by every entry of the same directory and removed with the last
+//  one. Watch limits are per user, so only a share of it is used, and
+//  directories past that are validated by stat instead.
+////////////////////////////////////////////////////////////////////////////////
+
+struct dc_watch_t {
+	uint64_t gen = 0;						// Bumped by every event on it
+	int refs = 0;							// Entries using it
+};
+
+struct dc_inotify_t {
+	std::mutex lock;
+	int fd = -1;
+	size_t max_watches = 0;
+	std::unordered_map<int, dc_watch_t> watches;	// wd -> watch
+	uint64_t overflows = 0;					// Bumped on IN_Q_OVERFLOW, invalidates every watch
+};
+
+#define DC_WATCH_SHARE 4	// Use up to 1/this of the user's inotify watch limit
+
+static auto& dc_inotify() {
+	static dc_inotify_t* in = [] {
+		auto* in = new dc_inotify_t;
+		in->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		long limit = 8192;
+		if (FILE* fp = fopen("/proc/sys/fs/inotify/max_user_watches", "r")) {
+			if (fscanf(fp, "%ld", &limit) != 1)
+				limit = 8192;
+			fclose(fp);
+		}
+		in->max_watches = limit / DC_WATCH_SHARE;
+		return in;
+	}();
+	return *in;
+}
+
+/**
+ * Add a watch on the directory open at dirfd. Fills in dent->wd and dent->wdgen,
+ * or leaves wd at -1 if watches are unavailable.
+ */
+static void dc_inotify_watch(dirent_t* dent, int dirfd) {
+	auto& in = dc_inotify();
+	if (in.fd < 0)
+		return;
+	
+	// Watch through the fd so we don't walk the path again
+	char fdpath[64];
+	snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", dirfd);
+	std::lock_guard<std::mutex> lock(in.lock);
+	if (in.watches.size() >= in.max_watches)
+		return; // Over our share, validated by stat instead
+	int wd = inotify_add_watch(in.fd, fdpath, IN_CREATE | IN_DELETE | IN_MOVED_FROM
+		| IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+	if (wd < 0)
+		return;
+	auto& w = in.watches[wd];
+	w.refs++;
+	dent->wd = wd;
+	dent->wdgen = w.gen;
+	dent->wdovf = in.overflows;
+}
+
+/**
+ * Share dent's watch with a copy of it
+ */
+static void dc_inotify_hold(int wd) {
+	if (wd < 0)
+		return;
+	auto& in = dc_inotify();
+	std::lock_guard<std::mutex> lock(in.lock);
+	in.watches[wd].refs++;
+}
+
+/**
+ * Let go of dent's watch, removing it if nothing else uses it
+ */
+static void dc_inotify_unwatch(dirent_t* dent) {
+	if (dent->wd < 0)
+		return;
+	auto& in = dc_inotify();
+	std::lock_guard<std::mutex> lock(in.lock);
+	auto it = in.watches.find(dent->wd);
+	if (it != in.watches.end() && --it->second.refs == 0) {
+		inotify_rm_watch(in.fd, dent->wd);
+		in.watches.erase(it);
+	}
+	dent->wd = -1;
+}
+
+/**
+ * Drain pending events and check whether dent's watch fired since populate
+ */
+static bool dc_inotify_changed(const dirent_t* dent) {
+	auto& in = dc_inotify();
+	alignas(inotify_event) char buf[4096];
+	std::lock_guard<std::mutex> lock(in.lock);
+	ssize_t n;
+	while ((n = read(in.fd, buf, sizeof(buf))) > 0) {
+		for (char* p = buf; p < buf + n;) {
+			auto* ev = (inotify_event*)p;
+			if (ev->mask & IN_Q_OVERFLOW)
+				in.overflows++;
+			else {
+				// Events may still arrive for watches removed since
+				auto it = in.watches.find(ev->wd);
+				if (it != in.watches.end())
+					it->second.gen++;
+			}
+			p += sizeof(inotify_event) + ev->len;
+		}
+	}
+	auto it = in.watches.find(dent->wd);
+	return it == in.watches.end() || it->second.gen != dent->wdgen || in.overflows != dent->wdovf;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Population
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Read the listing of the directory referred to by dirfd into a new,
+ * unreferenced entry. dirfd may be an O_PATH fd, st is its stat and becomes
+ * the revalidation baseline.
+ * If the mount's policy asks for it, entries the filesystem reports as
+ * DT_UNKNOWN get their type filled in with fstatat relative to dirfd.
+ */
+static dirent_t* dc_read_listing(dircache_t* cache, int dirfd, const char* path, const struct stat& st) {
+	auto* mount = dc_mount_for(cache, dirfd, st);
+	auto* dent = new dirent_t();
+	dent->cache = cache;
+	dent->path = path;
+	dent->hash = dc_hash_path(dent->path);
+	dent->nref.store(0);
+	dent->stale.store(false);
+	dent->version = 0;
+	dent->gen = cache->generation.load();
+	dent->st = st;
+	dent->mount = mount;
+	
+	// Watch before reading so changes made during the read aren't lost
+	if (mount->validate.load() == DIRCACHE_VALIDATE_INOTIFY)
+		dc_inotify_watch(dent, dirfd);
+	
+	dc_populate_enter(cache, mount);
+	int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR* dir = fd >= 0 ? fdopendir(fd) : nullptr;
+	if (!dir) {
+		dc_populate_leave(cache, mount);
+		if (fd >= 0)
+			close(fd);
+		dc_inotify_unwatch(dent);
+		delete dent;
+		return nullptr;
+	}
+	while (auto* d = readdir(dir)) {
+		// readdir's records are only as long as the name, don't copy past it
+		dent->entries.emplace_back();
+		auto& e = dent->entries.back();
+		memset(&e, 0, sizeof(e));
+		memcpy(&e, d, offsetof(dirent, d_name) + strlen(d->d_name) + 1);
+	}
+	closedir(dir);
+	
+	if (mount->stat_prefetch.load()) {
+		for (auto& e : dent->entries) {
+			struct stat est;
+			if (e.d_type == DT_UNKNOWN && !fstatat(dirfd, e.d_name, &est, AT_SYMLINK_NOFOLLOW))
+				e.d_type = IFTODT(est.st_mode);
+		}
+	}
+	dc_populate_leave(cache, mount);
+	dent->addedat.store(dc_get_time());
+	dent->usedat.store(dent->addedat.load());
+	
+	std::sort(dent->entries.begin(), dent->entries.end(),
+		[](const dirent& a, const dirent& b) {
+			return strcmp(a.d_name, b.d_name) < 0;
+		});
+	return dent;
+}
+
+/**
+ * Populate a fresh entry for path. Returns nullptr on error
+ */
+static dirent_t* dc_populate(dircache_t* cache, const char* path) {
+	int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return nullptr;
+	struct stat st;
+	auto* dent = fstat(fd, &st) == 0 ? dc_read_listing(cache, fd, path, st) : nullptr;
+	if (!dent) {
+		close(fd);
+		return nullptr;
+	}
+	dc_fd_adopt(dent, fd);
+	return dent;
+}
+
+static void dc_release(dirent_t* dent) {
+	// dent may be freed by someone else's purge as soon as we drop our ref
+	bool stale = dent->stale.load();
+	auto* cache = dent->cache;
+	dc_unref(dent); // Dec refcount
+	if (stale)
+		dc_reclaim_kick(cache, false);
+}
+
+/**
+ * Note a lookup of dent, for the cold tier. Only writes once per reclaimer tick
+ */
+static void dc_touch(dirent_t* dent) {
+	double now = dc_reclaimer().now.load(std::memory_order_relaxed);
+	if (now > dent->usedat.load(std::memory_order_relaxed))
+		dent->usedat.store(now, std::memory_order_relaxed);
+}
+
+static dirent_t* dc_thaw(dirent_t* dent);
+static dirent_t* dc_spill_restore(dircache_t* cache, const char* path);
+static void dc_sketch_record(dircache_t* cache, size_t hash);
+static bool dc_sketch_admits(dircache_t* cache, size_t hash);
+static dirent_t* dc_unlisted(dirent_t* dent);
+
+/**
+ * Lock-free lookup of a live entry, returned referenced.
+ * Never waits on writers or rehashes; if it races with one it just looks again.
+ * Cold entries are unpacked, so callers always get a listing in entries.
+ */
+static dirent_t* dc_db_get(dircache_t* cache, const char* path, size_t hash) {
+	AutoEpoch epoch;
+	for (;;) {
+		auto* dent = dc_table_find(dir_db(cache).load(std::memory_order_acquire), path, hash);
+		if (!dent)
+			return nullptr;
+		if (dent == DC_SLOT_MOVED)
+			return nullptr; // Cache is being destroyed
+		dc_ref(dent);
+		// Replaced between the lookup and the ref, the slot has moved on so look again
+		if (dent->stale.load()) {
+			dc_release(dent);
+			continue;
+		}
+		dc_touch(dent);
+		if (!dent->cold)
+			return dent;
+		if (auto* warm = dc_thaw(dent))
+			return warm;
+	}
+}
+
+static void dc_search_notify(dirent_t* dent);
+
+// Last version handed out, shared by all caches
+static auto& dc_version() {
+	static std::atomic<uint64_t> version {0};
+	return version;
+}
+
+static uint64_t dc_next_version() {
+	return dc_version().fetch_add(1) + 1;
+}
+
+/**
+ * Insert a new dent into the db.
+ * If another thread beat us to it, dent is freed and the winning entry
+ * is returned instead. The returned entry is referenced.
+ */
+static dirent_t* dc_publish(dirent_t* dent) {
+	dirent_t* out = dent;
+	auto* cache = dent->cache;
+	dir_db_lock(cache).write_lock();
+	auto* t = dir_db(cache).load(std::memory_order_relaxed);
+	ssize_t idx = dc_table_find_slot(t, dent->path.c_str(), dent->hash);
+	if (idx < 0) {
+		if ((t->used + 1) * 8 > t->ngroups * DC_GROUP_SIZE * 7) {
+			auto* nt = dc_table_rehash(t);
+			dir_db(cache).store(nt, std::memory_order_release);
+			dc_epoch_retire(t, dc_table_free);
+			t = nt;
+		}
+		dent->version = dc_next_version();
+		dent->history.clear(); // Nothing to continue from
+		dc_table_place(t, dent);
+	}
+	else {
+		out = t->slots[idx].load(std::memory_order_relaxed);
+	}
+	dc_ref(out);
+	dir_db_lock(cache).unlock();
+	
+	if (out != dent)
+		dc_free_ent(dent);
+	else
+		dc_search_notify(dent);
+	return out;
+}
+
+/**
+ * Merge-diff two sorted listings in one pass
+ */
+static std::shared_ptr<const dc_changeset_t> dc_diff_listings(const dirent_t* a, const dirent_t* b) {
+	auto set = std::make_shared<dc_changeset_t>();
+	set->from = a->version;
+	set->to = b->version;
+	auto& x = a->entries;
+	auto& y = b->entries;
+	size_t i = 0, j = 0;
+	while (i < x.size() || j < y.size()) {
+		int c = i == x.size() ? 1 : j == y.size() ? -1 : strcmp(x[i].d_name, y[j].d_name);
+		if (c < 0) {
+			set->changes.push_back({DIRCACHE_REMOVED, x[i].d_name, x[i].d_type, DT_UNKNOWN, x[i].d_ino, 0});
+			i++;
+		}
+		else if (c > 0) {
+			set->changes.push_back({DIRCACHE_ADDED, y[j].d_name, DT_UNKNOWN, y[j].d_type, 0, y[j].d_ino});
+			j++;
+		}
+		else {
+			if (x[i].d_type != y[j].d_type || x[i].d_ino != y[j].d_ino)
+				set->changes.push_back({DIRCACHE_CHANGED, y[j].d_name, x[i].d_type, y[j].d_type, x[i].d_ino, y[j].d_ino});
+			i++;
+			j++;
+		}
+	}
+	return set;
+}
+
+/**
+ * Whether two sorted listings hold the same entries
+ */
+static bool dc_same_listing(const dirent_t* a, const dirent_t* b) {
+	auto& x = a->entries;
+	auto& y = b->entries;
+	if (x.size() != y.size())
+		return false;
+	for (size_t i = 0; i < x.size(); ++i) {
+		if (x[i].d_ino != y[i].d_ino || x[i].d_type != y[i].d_type || strcmp(x[i].d_name, y[i].d_name))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Swap a refreshed listing in for prev with a CAS on its slot.
+ * Doesn't take the writer lock, so refreshes never wait on inserts or each
+ * other and readers never wait on refreshes. If prev was already replaced
+ * the newer entry wins and fresh is dropped.
+ * Returns a referenced entry; the caller's reference on prev is untouched.
+ */
+static dirent_t* dc_replace(dirent_t* fresh, dirent_t* prev) {
+	fresh->version = dc_next_version();
+	fresh->nref.store(1); // Caller's reference, taken before anyone can see it
+	fresh->accesses.store(prev->accesses.load(std::memory_order_relaxed)); // Still just as hot
+	
+	// Carry the change log forward, it's immutable once published
+	size_t keep = std::min(prev->history.size(), (size_t)DC_DIFF_HISTORY - 1);
+	fresh->history.assign(prev->history.end() - keep, prev->history.end());
+	fresh->history.push_back(dc_diff_listings(prev, fresh));
+	
+	// Keep the version a snapshot may still need reachable from the new one.
+	// Versions newer than the latest snapshot are of no use to any of them
+	if (prev->cache->nsnapshots.load()) {
+		std::lock_guard<std::mutex> lock(prev->cache->snaplock);
+		auto& vers = prev->cache->snapversions;
+		uint64_t newest = vers.empty() ? 0 : *vers.rbegin();
+		auto* keep = prev;
+		while (keep && keep->version > newest)
+			keep = keep->prev;
+		if (keep) {
+			dc_ref(keep);
+			fresh->prev = keep;
+		}
+	}
+	{
+		AutoEpoch epoch;
+		for (;;) {
+			std::atomic<dirent_t*>* slot = nullptr;
+			auto* t = dir_db(prev->cache).load(std::memory_order_acquire);
+			auto* cur = dc_table_find(t, prev->path.c_str(), prev->hash, &slot);
+			if (cur != prev)
+				break; // Already replaced or dropped
+			if (slot->compare_exchange_strong(cur, fresh)) {
+				dc_retire(prev);
+				dc_search_notify(fresh);
+				return fresh;
+			}
+			if (cur != DC_SLOT_MOVED)
+				break; // Otherwise frozen by a rehash just now, look again in the new table
+		}
+	}
+	
+	// Lost: use whatever is there now, or insert if it was dropped
+	fresh->nref.store(0);
+	if (auto* cur = dc_db_get(fresh->cache, fresh->path.c_str(), fresh->hash)) {
+		if (fresh->prev)
+			dc_release(fresh->prev);
+		dc_free_ent(fresh);
+		return cur;
+	}
+	return dc_publish(fresh);
+}
+
+static bool dc_is_expired(const dirent_t* dent) {
+	auto* mount = dent->mount;
+	if (mount->validate.load(std::memory_order_relaxed) == DIRCACHE_VALIDATE_NONE)
+		return false;
+	double ttl = mount->ttl_ms.load(std::memory_order_relaxed);
+	return dc_get_time() - dent->addedat.load(std::memory_order_relaxed) > ttl;
+}
+
+/**
+ * Whether an expired entry is still young enough to serve while it's
+ * refreshed in the background
+ */
+static bool dc_can_serve_stale(const dirent_t* dent) {
+	auto* mount = dent->mount;
+	double limit = mount->max_stale_ms.load(std::memory_order_relaxed);
+	if (limit <= 0)
+		return false;
+	double ttl = mount->ttl_ms.load(std::memory_order_relaxed);
+	return dc_get_time() - dent->addedat.load(std::memory_order_relaxed) <= ttl + limit;
+}
+
+static bool dc_stat_changed(const struct stat& a, const struct stat& b) {
+	return a.st_ino != b.st_ino
+		|| a.st_dev != b.st_dev
+		|| a.st_mtim.tv_sec != b.st_mtim.tv_sec
+		|| a.st_mtim.tv_nsec != b.st_mtim.tv_nsec
+		|| a.st_ctim.tv_sec != b.st_ctim.tv_sec
+		|| a.st_ctim.tv_nsec != b.st_ctim.tv_nsec;
+}
+
+static bool dc_swap(dirent_t* fresh, dirent_t* dent);
+
+/**
+ * Revalidate an expired, referenced entry according to its mount's policy.
+ * The pooled fd and any watch stay with the directory the path first led
+ * to, so the path is stat'ed first; if it now leads elsewhere (a swapped
+ * symlink, a directory moved away and recreated) it's repopulated by path.
+ * Otherwise the pooled fd saves the walk: if the directory changed it's
+ * repopulated relative to the same fd. Forced reloads, for entries from an
+ * older generation, drop the fd and always walk the path again.
+ * Returns a referenced entry to use in place of dent; dent's reference is consumed.
+ * Forced reloads that fail return nullptr, as an uncached open would.
+ */
+static dirent_t* dc_revalidate(dirent_t* dent, bool force) {
+	int validate = dent->mount->validate.load();
+	struct stat pst;
+	bool moved = !force && (stat(dent->path.c_str(), &pst) != 0
+		|| pst.st_ino != dent->st.st_ino || pst.st_dev != dent->st.st_dev);
+	if (!moved && !force && validate == DIRCACHE_VALIDATE_INOTIFY && dent->wd >= 0 && !dc_inotify_changed(dent)) {
+		dent->addedat.store(dc_get_time(), std::memory_order_relaxed);
+		return dent;
+	}
+	
+	// An invalidation may be about where the path leads, so don't trust the fd
+	bool walk = moved || force;
+	if (force)
+		dc_fd_drop(dent);
+	int fd = walk ? -1 : dc_fd_pin(dent);
+	if (fd < 0 && !walk)
+		return dent; // Directory is gone, keep serving what we have
+	
+	struct stat st;
+	bool gone = walk || fstat(fd, &st) != 0 || st.st_nlink == 0;
+	// TTL mode always rereads, and if we got here with a watch it fired
+	bool changed = force || gone || validate == DIRCACHE_VALIDATE_TTL || dent->wd >= 0
+		|| dc_stat_changed(st, dent->st);
+	
+	if (!changed) {
+		dc_fd_unpin(dent);
+		dent->addedat.store(dc_get_time(), std::memory_order_relaxed);
+		return dent;
+	}
+	
+	// A removed or moved directory needs a fresh path walk, otherwise reuse the fd
+	auto* fresh = gone ? dc_populate(dent->cache, dent->path.c_str())
+		: dc_read_listing(dent->cache, fd, dent->path.c_str(), st);
+	if (fd >= 0)
+		dc_fd_unpin(dent);
+	if (!fresh) {
+		if (!force)
+			return dent;
+		dc_release(dent);
+		return nullptr;
+	}
+	if (!force && !gone && dc_same_listing(dent, fresh)) {
+		// Touched but not changed. A new version would only use up history, but
+		// the reread's stat and watch generation are what later checks compare to
+		fresh->version = dent->version;
+		fresh->history = dent->history;
+		fresh->accesses.store(dent->accesses.load(std::memory_order_relaxed));
+		fresh->nref.store(1);
+		if (dc_swap(fresh, dent)) {
+			dc_release(dent);
+			return fresh;
+		}
+		// Replaced meanwhile, whatever replaced it is at least as new
+		fresh->nref.store(0);
+		dc_free_ent(fresh);
+		dent->addedat.store(dc_get_time(), std::memory_order_relaxed);
+		return dent;
+	}
+	
+	auto* out = dc_replace(fresh, dent);
+	dc_release(dent);
+	return out;
+}
+
+/**
+ * Queue a revalidation of dent on a background worker, unless one is already queued
+ */
+static void dc_refresh_async(dirent_t* dent) {
+	if (dent->refreshing.exchange(true))
+		return;
+	dc_ref(dent); // Held by the worker
+	dc_work_submit(dent->cache, [dent] {
+		dc_ref(dent); // Kept across the revalidate, which consumes one
+		dc_release(dc_revalidate(dent, false));
+		dent->refreshing.store(false);
+		dc_release(dent);
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Child prefetch
+//  Callers tend to open a directory's subdirectories right after it, so a
+//  demand populate queues its DT_DIR children on the prefetch workers.
+//  Bounded by fan-out, depth and queue length, and paused for a while
+//  whenever too few prefetched entries get used.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DC_PREFETCH_WINDOW 256		// Prefetches per hit ratio check
+#define DC_PREFETCH_BACKOFF 1024	// Demand populates to sit out after a bad window
+
+// Why an entry was loaded ahead of demand, see dirent_t::prefetched
+#define DC_PREFETCH_CHILD 1
+#define DC_PREFETCH_TRACE 2
+
+static void dc_prefetch_children(dirent_t* dent);
+
+/**
+ * Count a prefetched entry's first use
+ */
+static void dc_prefetch_hit(dirent_t* dent) {
+	if (!dent->prefetched.load(std::memory_order_relaxed))
+		return;
+	switch (dent->prefetched.exchange(0)) {
+	case DC_PREFETCH_CHILD:
+		dent->cache->prefetch.hits++;
+		dent->cache->prefetch.win_hits++;
+		break;
+	case DC_PREFETCH_TRACE:
+		dent->cache->trace.hits++;
+		break;
+	}
+}
+
+/**
+ * Account for one more prefetch, and pause prefetching if the last
+ * window of them mostly went unused
+ */
+static void dc_prefetch_issue(dircache_t* cache) {
+	auto& pf = cache->prefetch;
+	pf.issued++;
+	if (pf.win_issued.fetch_add(1) + 1 < DC_PREFETCH_WINDOW)
+		return;
+	double ratio = (double)pf.win_hits.exchange(0) / DC_PREFETCH_WINDOW;
+	pf.win_issued.store(0);
+	if (ratio < pf.min_hit_ratio.load())
+		pf.off_until.store(cache->populates.load() + DC_PREFETCH_BACKOFF);
+}
+
+/**
+ * Background populate of a directory nobody has asked for yet
+ */
+static void dc_prefetch_load(dircache_t* cache, const std::string& path, int depth, uint8_t source) {
+	size_t hash = dc_hash_path(path);
+	auto* prev = dc_db_get(cache, path.c_str(), hash);
+	if (prev && prev->gen == cache->generation.load(std::memory_order_relaxed)) {
+		dc_release(prev);
+		return; // Already current
+	}
+	if (!prev && !dc_sketch_admits(cache, hash))
+		return; // Would only be read to be thrown away
+	if (auto* f = dc_flight_join(cache, path.c_str())) {
+		if (prev)
+			dc_release(prev);
+		dc_flight_wait(cache, f); // Someone else is already on it
+		return;
+	}
+	dirent_t* dent;
+	if (prev) {
+		// From before an invalidation, reload it in place like an open would
+		if ((dent = dc_revalidate(prev, true))) {
+			dent->depth = depth;
+			dent->prefetched.store(source);
+		}
+	}
+	else if ((dent = dc_spill_restore(cache, path.c_str()))) {
+		dent->depth = depth;
+		dent->prefetched.store(source);
+	}
+	else if ((dent = dc_populate(cache, path.c_str()))) {
+		dent->depth = depth;
+		dent->prefetched.store(source);
+		dent = dc_publish(dent);
+	}
+	if (dent && source == DC_PREFETCH_TRACE)
+		cache->trace.issued++;
+	dc_flight_finish(cache, path.c_str(), dent ? 0 : errno ? errno : ENOENT);
+	if (dent) {
+		dc_prefetch_children(dent);
+		dc_release(dent);
+	}
+}
+
+/**
+ * Queue prefetches for the subdirectories of a freshly read entry
+ */
+static void dc_prefetch_children(dirent_t* dent) {
+	auto* cache = dent->cache;
+	auto& pf = cache->prefetch;
+	if (!pf.enabled.load(std::memory_order_relaxed)
+		|| dent->depth >= pf.max_depth.load()
+		|| cache->populates.load() < pf.off_until.load())
+		return;
+	
+	int fanout = pf.max_fanout.load();
+	int max_queued = pf.max_queued.load();
+	for (auto& e : dent->entries) {
+		if (fanout <= 0 || pf.queued.load() >= max_queued)
+			break;
+		if (e.d_type != DT_DIR || !strcmp(e.d_name, ".") || !strcmp(e.d_name, ".."))
+			continue;
+		std::string path = dent->path == "/" ? "/" : dent->path + "/";
+		path += e.d_name;
+		fanout--;
+		pf.queued++;
+		dc_prefetch_issue(cache);
+		dc_work_submit(cache, [cache, path = std::move(path), depth = dent->depth + 1] {
+			dc_prefetch_load(cache, path, depth, DC_PREFETCH_CHILD);
+			cache->prefetch.queued--;
+		}, dc_prefetchers());
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Trace prefetch
+//  Learns which directory a thread tends to open after another, and loads
+//  the likely next ones in the background as soon as the first is opened.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DC_TRACE_MIN_COUNT 2		// Transitions seen before one is trusted
+#define DC_TRACE_MIN_SHARE 4		// ... and it must be at least 1/this of its row
+
+/**
+ * Count a from -> dent transition, replacing the row's least seen successor if needed
+ */
+static void dc_trace_bump(dc_trace_t& tr, dc_trace_row_t* rows, size_t from, const dirent_t* dent) {
+	size_t i = from % DC_TRACE_ROWS;
+	std::lock_guard<std::mutex> lock(tr.locks[i % DC_TRACE_STRIPES]);
+	auto& row = rows[i];
+	if (row.from != from) {
+		row.from = from;
+		for (auto& n : row.next)
+			n.count = 0;
+	}
+	dc_trace_next_t* victim = &row.next[0];
+	for (auto& n : row.next) {
+		if (n.count && n.hash == dent->hash) {
+			if (++n.count == UINT16_MAX) {
+				for (auto& m : row.next)
+					m.count /= 2; // Age so newer patterns can take over
+			}
+			return;
+		}
+		if (n.count < victim->count)
+			victim = &n;
+	}
+	victim->hash = dent->hash;
+	victim->count = 1;
+	victim->path = dent->path;
+}
+
+/**
+ * Prefetch the directories usually opened after the one with this hash
+ */
+static void dc_trace_predict(dircache_t* cache, dc_trace_row_t* rows, size_t hash) {
+	std::string likely[DC_TRACE_WAYS];
+	int n = 0;
+	{
+		size_t i = hash % DC_TRACE_ROWS;
+		std::lock_guard<std::mutex> lock(cache->trace.locks[i % DC_TRACE_STRIPES]);
+		auto& row = rows[i];
+		if (row.from != hash)
+			return;
+		uint32_t total = 0;
+		for (auto& next : row.next)
+			total += next.count;
+		for (auto& next : row.next) {
+			if (next.count >= DC_TRACE_MIN_COUNT && next.count * DC_TRACE_MIN_SHARE >= total)
+				likely[n++] = next.path;
+		}
+	}
+	
+	auto& pf = cache->prefetch;
+	for (int i = 0; i < n; ++i) {
+		if (auto* dent = dc_db_get(cache, likely[i].c_str(), dc_hash_path(likely[i]))) {
+			bool current = dent->gen == cache->generation.load(std::memory_order_relaxed);
+			dc_release(dent);
+			if (current)
+				continue; // Already there
+		}
+		if (pf.queued.load() >= pf.max_queued.load())
+			return;
+		pf.queued++;
+		dc_work_submit(cache, [cache, path = std::move(likely[i])] {
+			// Past any depth limit, so its children aren't prefetched too
+			dc_prefetch_load(cache, path, INT_MAX, DC_PREFETCH_TRACE);
+			cache->prefetch.queued--;
+		}, dc_prefetchers());
+	}
+}
+
+/**
+ * Note that the calling thread opened dent, and prefetch what tends to follow it
+ */
+static void dc_trace_record(dirent_t* dent) {
+	auto* cache = dent->cache;
+	auto& tr = cache->trace;
+	if (!tr.enabled.load(std::memory_order_relaxed))
+		return;
+	auto* rows = tr.rows.load(std::memory_order_acquire);
+	
+	thread_local dircache_t* last_cache = nullptr;
+	thread_local size_t last_hash = 0;
+	if (last_cache == cache && last_hash != dent->hash)
+		dc_trace_bump(tr, rows, last_hash, dent);
+	last_cache = cache;
+	last_hash = dent->hash;
+	
+	dc_trace_predict(cache, rows, dent->hash);
+}
+
+#define DC_ACCESS_SAMPLE 16
+
+/**
+ * Count a lookup of dent for the hot set. Each lookup writes the counter
+ * with probability 1/DC_ACCESS_SAMPLE, so hot entries aren't contended.
+ * Sampled at random rather than every n'th lookup, which would skip
+ * entries looked up in a cycle of a multiple of n.
+ */
+static void dc_count_access(dirent_t* dent) {
+	static std::atomic<uint32_t> seeds {0};
+	thread_local uint32_t x = (seeds.fetch_add(1, std::memory_order_relaxed) + 1) * 0x9E3779B9u;
+	x ^= x << 13; // xorshift32
+	x ^= x >> 17;
+	x ^= x << 5;
+	if (x % DC_ACCESS_SAMPLE == 0)
+		dent->accesses.fetch_add(DC_ACCESS_SAMPLE, std::memory_order_relaxed);
+}
+
+/**
+ * Find or populate the dir in the db and take a reference on it
+ * Reads the dir outright if it doesn't exist in the db yet,
+ * then stores off those results, if admitted.
+ * The returned entry must be released with dc_release
+ */
+static dirent_t* dc_acquire(dircache_t* cache, const char* path) {
+	size_t hash = dc_hash_path(path);
+	bool joined = false;
+	dc_sketch_record(cache, hash);
+	for (;;) {
+		// Try to get an entry
+		dirent_t* dent = dc_db_get(cache, path, hash);
+		if (dent)
+			dc_prefetch_hit(dent);
+		if (dent && joined)
+			return dent; // Whatever the load we waited on left behind
+		bool current = dent && dent->gen == cache->generation.load(std::memory_order_relaxed);
+		if (current) {
+			if (!dc_is_expired(dent))
+				return dent;
+			if (dc_can_serve_stale(dent)) {
+				dc_refresh_async(dent);
+				return dent;
+			}
+		}
+		
+		// Missing, expired, or invalidated since it was read. Everyone who
+		// wants it now waits on a single load rather than all hitting the filesystem
+		if (auto* f = dc_flight_join(cache, path)) {
+			if (dent)
+				dc_release(dent);
+			dirent_t* handed;
+			int err = dc_flight_wait(cache, f, &handed);
+			if (err) {
+				errno = err;
+				return nullptr;
+			}
+			if (handed)
+				return handed; // Not admitted, so there's nothing to look up
+			joined = true;
+			continue;
+		}
+		
+		// Expired, check it per its policy. Never fails, at worst dent is kept
+		if (current) {
+			dent = dc_revalidate(dent, false);
+			dc_flight_finish(cache, path, 0);
+			return dent;
+		}
+		
+		// read contents and store into the db.
+		errno = 0;
+		bool read = true, unlisted = false;
+		if (dent)
+			dent = dc_revalidate(dent, true);
+		else if ((dent = dc_spill_restore(cache, path)))
+			read = false;
+		else if ((dent = dc_populate(cache, path))) {
+			unlisted = !dc_sketch_admits(cache, hash);
+			dent = unlisted ? dc_unlisted(dent) : dc_publish(dent);
+		}
+		int err = dent ? 0 : errno ? errno : ENOENT;
+		dc_flight_finish(cache, path, err, unlisted ? dent : nullptr);
+		if (!dent) {
+			errno = err;
+			return nullptr;
+		}
+		if (read)
+			cache->populates++;
+		if (!unlisted)
+			dc_prefetch_children(dent);
+		return dent;
+	}
+}
+
+/**
+ * Find or populate the dir in the db
+ * Returns a new context positioned at the first entry
+ */
+static dircontext_t* dc_find_or_populate(dircache_t* cache, const char* path) {
+	auto* dent = dc_acquire(cache, path);
+	if (!dent)
+		return nullptr;
+	dc_count_access(dent);
+	dc_trace_record(dent);
+	auto* ctx = dc_build_around_ent(dent);
+	dc_release(dent); // Context holds its own reference now
+	return ctx;
+}
+
+#define DC_TIMED_LOADERS 16		// Loads dc_acquire_timeout may have on their own threads, per cache
+
+static void dc_teardown(dircache_t* cache);
+
+/**
+ * Result of a load handed off to its own thread by dc_acquire_timeout
+ */
+struct dc_timed_load_t {
+	std::mutex lock;
+	std::condition_variable cv;
+	bool done = false;
+	dirent_t* dent = nullptr;		// Referenced result, until taken
+	int err = 0;
+	int users = 2;					// Loader and caller, the last one out frees it
+};
+
+/**
+ * Let go of a loader slot. The last loader out of a cache destroyed while
+ * it was stuck is the one that frees it.
+ */
+static void dc_timed_loaders_leave(dircache_t* cache) {
+	if (--cache->timed_loaders == 0 && cache->destroying.load() && !cache->torn_down.exchange(true))
+		dc_teardown(cache);
+}
+
+static void dc_timed_load_put(dc_timed_load_t* load, std::unique_lock<std::mutex>& lock) {
+	if (--load->users)
+		return;
+	lock.unlock();
+	if (load->dent)
+		dc_release(load->dent);
+	delete load;
+}
+
+/**
+ * Like dc_acquire, but gives up after ms if the filesystem doesn't answer.
+ * The load runs on its own thread, so a hung mount only ties up threads
+ * that are already stuck in it. A path already being loaded is waited on
+ * rather than loaded again, and at most DC_TIMED_LOADERS threads are out
+ * at once. When out of time or threads, the last known listing is
+ * returned, whatever its age, or nullptr with ETIMEDOUT or EAGAIN.
+ */
+static dirent_t* dc_acquire_timeout(dircache_t* cache, const char* path, double ms) {
+	// Anything that can be answered without touching the filesystem goes inline
+	size_t hash = dc_hash_path(path);
+	if (auto* dent = dc_db_get(cache, path, hash)) {
+		bool current = dent->gen == cache->generation.load(std::memory_order_relaxed);
+		if (current && (!dc_is_expired(dent) || dc_can_serve_stale(dent))) {
+			dc_release(dent);
+			return dc_acquire(cache, path);
+		}
+		dc_release(dent);
+	}
+	
+	int err = ETIMEDOUT;
+	if (auto* f = dc_flight_find(cache, path)) {
+		// Someone is already reading it, possibly stuck
+		dirent_t* handed;
+		if (dc_flight_wait_for(cache, f, ms, &err, &handed)) {
+			if (handed)
+				return handed;
+			if (!err)
+				return dc_acquire(cache, path);
+			errno = err;
+			return nullptr;
+		}
+	}
+	else if (++cache->timed_loaders > DC_TIMED_LOADERS) {
+		dc_timed_loaders_leave(cache);
+		err = EAGAIN;
+	}
+	else {
+		auto* load = new dc_timed_load_t;
+		try {
+			std::thread([cache, load, p = std::string(path)] {
+				auto* dent = dc_acquire(cache, p.c_str());
+				int err = errno;
+				std::unique_lock<std::mutex> lock(load->lock);
+				load->dent = dent;
+				load->err = dent ? 0 : err;
+				load->done = true;
+				load->cv.notify_all();
+				dc_timed_load_put(load, lock);
+				dc_timed_loaders_leave(cache);
+			}).detach();
+		}
+		catch (const std::system_error& e) {
+			delete load;
+			dc_timed_loaders_leave(cache);
+			err = e.code().value();
+			load = nullptr;
+		}
+		if (load) {
+			std::unique_lock<std::mutex> lock(load->lock);
+			load->cv.wait_for(lock, std::chrono::duration<double, std::milli>(ms), [load] { return load->done; });
+			if (load->done) {
+				auto* dent = load->dent;
+				err = load->err;
+				load->dent = nullptr;
+				dc_timed_load_put(load, lock);
+				if (!dent)
+					errno = err;
+				return dent;
+			}
+			dc_timed_load_put(load, lock);
+		}
+	}
+	
+	// Out of time, fall back to whatever we had
+	if (auto* dent = dc_db_get(cache, path, hash))
+		return dent;
+	errno = err;
+	return nullptr;
+}
+
+/**
+ * Binary search for name in the (sorted) entry list
+ */
+static const dirent* dc_lookup_name(const dirent_t* dent, const char* name) {
+	size_t lo = 0, hi = dent->entries.size();
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int c = strcmp(dent->entries[mid].d_name, name);
+		if (c == 0)
+			return &dent->entries[mid];
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return nullptr;
+}
+
+static void dc_close(dircontext_t* context) {
+	if (context->ent)
+		dc_release(context->ent); // Dec refcount, purges if stale
+	memset(context, 0, sizeof(*context)); // For safety :)
+	delete context;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Built-in filters
+//  Extension, prefix and type filters evaluated over packed columns, two
+//  entries per compare with SSE2. Listings from an offline index have no
+//  columns and are filtered one entry at a time.
+////////////////////////////////////////////////////////////////////////////////
+
+static const char* dc_extension(const char* name) {
+	const char* dot = strrchr(name, '.');
+	return dot && dot != name ? dot + 1 : nullptr;
+}
+
+/**
+ * Zero padded little end first packing of up to 8 bytes of s
+ */
+static uint64_t dc_pack8(const char* s, size_t len) {
+	uint64_t v = 0;
+	memcpy(&v, s, len < 8 ? len : 8);
+	return v;
+}
+
+static dc_columns_t* dc_columns_for(dirent_t* dent) {
+	if (auto* cols = dent->columns.load(std::memory_order_acquire))
+		return cols;
+	
+	auto* cols = new dc_columns_t;
+	size_t n = dent->entries.size();
+	cols->ext.resize(n);
+	cols->head.resize(n);
+	cols->extlong.resize(n);
+	for (size_t i = 0; i < n; ++i) {
+		const char* name = dent->entries[i].d_name;
+		cols->head[i] = dc_pack8(name, strnlen(name, 8));
+		if (const char* ext = dc_extension(name)) {
+			size_t len = strlen(ext);
+			cols->extlong[i] = len > 8;
+			cols->ext[i] = len > 8 ? 0 : dc_pack8(ext, len);
+		}
+	}
+	
+	dc_columns_t* expected = nullptr;
+	if (!dent->columns.compare_exchange_strong(expected, cols)) {
+		delete cols;
+		return expected;
+	}
+	return cols;
+}
+
+/**
+ * out[i] |= (col[i] & mask) == val
+ */
+static void dc_match_u64(const uint64_t* col, size_t n, uint64_t mask, uint64_t val, uint8_t* out) {
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i m = _mm_set1_epi64x(mask), v = _mm_set1_epi64x(val);
+	for (; i + 2 <= n; i += 2) {
+		__m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i*)(col + i)), m);
+		// No 64 bit compare in SSE2, AND each 32 bit half with its neighbor
+		__m128i eq = _mm_cmpeq_epi32(c, v);
+		eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+		int bits = _mm_movemask_pd(_mm_castsi128_pd(eq));
+		out[i] |= bits & 1;
+		out[i + 1] |= bits >> 1;
+	}
+#endif
+	for (; i < n; ++i)
+		out[i] |= (col[i] & mask) == val;
+}
+
+static bool dc_filter_type(const dircache_filter_t* f, const dirent* e) {
+	return !f->type_mask || (f->type_mask & DIRCACHE_TYPE_BIT(e->d_type));
+}
+
+/**
+ * Reference implementation, one entry at a time
+ */
+static bool dc_filter_match(const dircache_filter_t* f, const dirent* e) {
+	if (!dc_filter_type(f, e))
+		return false;
+	if (f->nextensions) {
+		const char* ext = dc_extension(e->d_name);
+		bool hit = false;
+		for (int i = 0; i < f->nextensions && !hit; ++i)
+			hit = ext ? !strcmp(ext, f->extensions[i]) : !*f->extensions[i];
+		if (!hit)
+			return false;
+	}
+	if (f->nprefixes) {
+		bool hit = false;
+		for (int i = 0; i < f->nprefixes && !hit; ++i)
+			hit = !strncmp(e->d_name, f->prefixes[i], strlen(f->prefixes[i]));
+		if (!hit)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Evaluate the filter over a whole listing, setting pass[i] for each entry that matches
+ */
+static void dc_filter_eval(const dircache_filter_t* f, dirent_t* dent, uint8_t* pass) {
+	size_t n = dent->entries.size();
+	auto* cols = dc_columns_for(dent);
+	std::vector<uint8_t> hit(n);
+	
+	for (size_t i = 0; i < n; ++i)
+		pass[i] = dc_filter_type(f, &dent->entries[i]);
+	
+	if (f->nextensions) {
+		bool longexts = false;
+		for (int k = 0; k < f->nextensions; ++k) {
+			size_t len = strlen(f->extensions[k]);
+			if (len > 8)
+				longexts = true;
+			else
+				dc_match_u64(cols->ext.data(), n, ~0ull, dc_pack8(f->extensions[k], len), hit.data());
+		}
+		for (size_t i = 0; i < n; ++i) {
+			// Long extensions packed as 0 would look like "no extension"
+			if (cols->extlong[i])
+				hit[i] = longexts && dc_filter_match(f, &dent->entries[i]);
+			pass[i] &= hit[i];
+		}
+	}
+	
+	if (f->nprefixes) {
+		std::fill(hit.begin(), hit.end(), 0);
+		bool longpfx = false;
+		for (int k = 0; k < f->nprefixes; ++k) {
+			size_t len = strlen(f->prefixes[k]);
+			if (len > 8) {
+				longpfx = true;
+				continue;
+			}
+			uint64_t mask = len == 8 ? ~0ull : (1ull << (len * 8)) - 1;
+			dc_match_u64(cols->head.data(), n, mask, dc_pack8(f->prefixes[k], len), hit.data());
+		}
+		for (size_t i = 0; i < n; ++i) {
+			if (!hit[i] && longpfx && pass[i])
+				hit[i] = dc_filter_match(f, &dent->entries[i]);
+			pass[i] &= hit[i];
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Offline index
+//  Immutable trees can be scanned once into an index file which is then
+//  mmap'd. Lookups under its root are answered straight from the mapping
+//  with no locks and no syscalls.
+////////////////////////////////////////////////////////////////////////////////
+
+struct dc_index_t {
+	const char* base;
+	size_t size;
+	const char* root;
+	size_t rootlen;
+	const dc_index_header_t* hdr;
+	const dc_index_dir_t* dirs;
+};
+
+#define DC_MAX_INDEXES 16
+
+// Loaded indexes are published once and never unmapped
+static std::atomic<dc_index_t*> dc_indexes[DC_MAX_INDEXES];
+static std::atomic_int dc_nindexes {0};
+
+/**
+ * Look up an absolute, fixed path in the loaded indexes.
+ * Returns 1 and fills dir/base if found, 0 if path is under an indexed root
+ * but isn't a directory in it, and -1 if no index covers it.
+ */
+static int dc_index_find(const char* path, const dc_index_dir_t** dir, const char** base) {
+	int n = dc_nindexes.load(std::memory_order_acquire);
+	for (int i = 0; i < n; ++i) {
+		auto* idx = dc_indexes[i].load(std::memory_order_acquire);
+		if (!idx || strncmp(path, idx->root, idx->rootlen))
+			continue;
+		const char* rel = path + idx->rootlen;
+		if (*rel == '/')
+			rel++;
+		else if (*rel && idx->rootlen > 1)
+			continue; // Only a prefix of the name, e.g. /foo vs /foobar
+		
+		size_t lo = 0, hi = idx->hdr->ndirs;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			int c = strcmp(idx->base + idx->dirs[mid].path_off, rel);
+			if (c == 0) {
+				*dir = &idx->dirs[mid];
+				*base = idx->base;
+				return 1;
+			}
+			if (c < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+static dircontext_t* dc_build_around_index(const dc_index_dir_t* dir, const char* base) {
+	auto* ctx = new dircontext_t;
+	ctx->ent = nullptr;
+	ctx->idx = dir;
+	ctx->ibase = base;
+	ctx->pos = 0;
+	return ctx;
+}
+
+static const dirent* dc_index_lookup_name(const dc_index_dir_t* dir, const char* base, const char* name) {
+	auto* offs = (const uint64_t*)(base + dir->ents_off);
+	size_t lo = 0, hi = dir->nents;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		auto* e = (const dirent*)(base + offs[mid]);
+		int c = strcmp(e->d_name, name);
+		if (c == 0)
+			return e;
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return nullptr;
+}
+
+/**
+ * Directory collected while building an index
+ */
+struct dc_build_dir_t {
+	std::string rel;
+	std::vector<std::string> recs;	// Serialized dirent records, sorted by name
+};
+
+static size_t dc_reclen(size_t namelen) {
+	return (offsetof(dirent, d_name) + namelen + 1 + 7) & ~(size_t)7;
+}
+
+/**
+ * Recursively collect dirfd (at rel) and its subdirectories. Symlinks are not followed
+ */
+static int dc_build_walk(int dirfd, const std::string& rel, std::vector<dc_build_dir_t>& out) {
+	int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR* dir = fd >= 0 ? fdopendir(fd) : nullptr;
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	
+	dc_build_dir_t bd;
+	bd.rel = rel;
+	std::vector<std::string> subdirs;
+	while (auto* d = readdir(dir)) {
+		unsigned char type = d->d_type;
+		struct stat st;
+		if (type == DT_UNKNOWN && !fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			type = IFTODT(st.st_mode);
+		
+		size_t namelen = strlen(d->d_name);
+		std::string rec(dc_reclen(namelen), '\0');
+		auto* e = (dirent*)rec.data();
+		e->d_ino = d->d_ino;
+		e->d_reclen = rec.size();
+		e->d_type = type;
+		memcpy(e->d_name, d->d_name, namelen + 1);
+		bd.recs.push_back(std::move(rec));
+		
+		if (type == DT_DIR && strcmp(d->d_name, ".") && strcmp(d->d_name, ".."))
+			subdirs.push_back(d->d_name);
+	}
+	closedir(dir);
+	
+	std::sort(bd.recs.begin(), bd.recs.end(), [](const std::string& a, const std::string& b) {
+		return strcmp(((const dirent*)a.data())->d_name, ((const dirent*)b.data())->d_name) < 0;
+	});
+	for (size_t i = 0; i < bd.recs.size(); ++i)
+		((dirent*)bd.recs[i].data())->d_off = i + 1;
+	out.push_back(std::move(bd));
+	
+	for (auto& sub : subdirs) {
+		int subfd = openat(dirfd, sub.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (subfd < 0)
+			continue; // Raced with a removal, or unreadable
+		dc_build_walk(subfd, rel.empty() ? sub : rel + "/" + sub, out);
+		close(subfd);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Glob
+//  Pattern components are matched against cached listings instead of
+//  opendir/readdir/stat on every expansion. Once a wildcard fans out into
+//  enough directories, the next level of each is expanded in parallel.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DC_GLOB_PARALLEL 8		// Directories at one level before expanding them in parallel
+#define DC_GLOB_THREADS 4
+
+static bool dc_glob_has_magic(const std::string& comp, int flags) {
+	for (size_t i = 0; i < comp.size(); ++i) {
+		if (comp[i] == '\\' && !(flags & GLOB_NOESCAPE))
+			++i;
+		else if (comp[i] == '*' || comp[i] == '?' || comp[i] == '[')
+			return true;
+	}
+	return false;
+}
+
+static std::string dc_glob_unescape(const std::string& comp, int flags) {
+	if (flags & GLOB_NOESCAPE)
+		return comp;
+	std::string out;
+	for (size_t i = 0; i < comp.size(); ++i) {
+		if (comp[i] == '\\' && i + 1 < comp.size())
+			++i;
+		out += comp[i];
+	}
+	return out;
+}
+
+static std::string dc_glob_join(const std::string& dir, const char* name) {
+	if (dir.empty())
+		return name;
+	return dir.back() == '/' ? dir + name : dir + "/" + name;
+}
+
+/**
+ * Whether path is a directory, following symlinks like glob(3) does.
+ * type is its d_type, if known
+ */
+static bool dc_glob_is_dir(const std::string& path, unsigned char type) {
+	if (type == DT_DIR)
+		return true;
+	if (type != DT_LNK && type != DT_UNKNOWN)
+		return false;
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Match comp against the cached listing of dir ("" for the cwd), appending
+ * matching paths to out. Returns 0, or the errno if dir couldn't be listed
+ */
+static int dc_glob_expand(dircache_t* cache, const std::string& dir, const std::string& comp,
+	int flags, bool dirs_only, std::vector<std::string>& out) {
+	errno = 0;
+	auto* ctx = dircache_opendir_in(cache, dir.empty() ? "." : dir.c_str());
+	if (!ctx)
+		return errno ? errno : ENOENT;
+	int fnflags = (flags & GLOB_NOESCAPE ? FNM_NOESCAPE : 0) | (flags & GLOB_PERIOD ? 0 : FNM_PERIOD);
+	while (auto* e = dircache_readdir(ctx)) {
+		// . and .. only come from patterns that ask for a leading dot
+		bool dots = !strcmp(e->d_name, ".") || !strcmp(e->d_name, "..");
+		if ((dots && comp[0] != '.') || fnmatch(comp.c_str(), e->d_name, fnflags))
+			continue;
+		auto path = dc_glob_join(dir, e->d_name);
+		if (dirs_only && !dc_glob_is_dir(path, e->d_type))
+			continue;
+		out.push_back(std::move(path));
+	}
+	dircache_closedir(ctx);
+	return 0;
+}
+
+/**
+ * Expand pattern a component at a time into out, unsorted.
+ * Returns 0 or a GLOB_xxx error
+ */
+static int dc_glob(dircache_t* cache, const char* pattern, int flags, std::vector<std::string>& out) {
+	std::vector<std::string> comps;
+	for (const char* p = pattern; *p;) {
+		const char* end = strchrnul(p, '/');
+		if (end != p)
+			comps.emplace_back(p, end);
+		p = *end ? end + 1 : end;
+	}
+	size_t len = strlen(pattern);
+	bool trailing = len && pattern[len - 1] == '/'; // Only directories, and keep the slash
+	std::vector<std::string> level = {pattern[0] == '/' ? "/" : ""};
+	if (comps.empty()) {
+		if (pattern[0] == '/')
+			out = level;
+		return 0;
+	}
+	
+	for (size_t i = 0; i < comps.size() && !level.empty(); ++i) {
+		bool last = i + 1 == comps.size();
+		bool dirs_only = !last || trailing;
+		std::vector<std::string> next;
+		
+		if (!dc_glob_has_magic(comps[i], flags)) {
+			// Literal directories in the middle are checked when they're listed
+			auto name = dc_glob_unescape(comps[i], flags);
+			for (auto& dir : level) {
+				auto path = dc_glob_join(dir, name.c_str());
+				if (!last || (dircache_exists_in(cache, path.c_str())
+					&& (!trailing || dc_glob_is_dir(path, DT_UNKNOWN))))
+					next.push_back(std::move(path));
+			}
+			level = std::move(next);
+			continue;
+		}
+		
+		// Each directory at this level is an independent branch
+		std::vector<std::vector<std::string>> found(level.size());
+		std::vector<int> errs(level.size());
+		std::atomic_size_t nextdir {0};
+		auto worker = [&] {
+			for (size_t j; (j = nextdir.fetch_add(1)) < level.size();)
+				errs[j] = dc_glob_expand(cache, level[j], comps[i], flags, dirs_only, found[j]);
+		};
+		std::vector<std::thread> threads;
+		if (level.size() >= DC_GLOB_PARALLEL) {
+			try {
+				for (int t = 1; t < DC_GLOB_THREADS; ++t)
+					threads.emplace_back(worker);
+			}
+			catch (const std::system_error&) {
+				// Out of threads, this one takes whatever the others don't
+			}
+		}
+		worker();
+		for (auto& t : threads)
+			t.join();
+		
+		for (size_t j = 0; j < level.size(); ++j) {
+			// Missing directories just don't match, like glob(3)
+			if ((flags & GLOB_ERR) && errs[j] && errs[j] != ENOENT && errs[j] != ENOTDIR)
+				return GLOB_ABORTED;
+			for (auto& path : found[j])
+				next.push_back(std::move(path));
+		}
+		level = std::move(next);
+	}
+	
+	for (auto& path : level) {
+		if (trailing || ((flags & GLOB_MARK) && dc_glob_is_dir(path, DT_UNKNOWN)))
+			path += '/';
+	}
+	out = std::move(level);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Union views
+//  A merged listing of several directories, kept in an unpublished dirent_t
+//  so contexts, filters and reclamation work on it like any other entry.
+//  Memoized by the versions of its constituents, so any repopulate of one
+//  of them rebuilds it on the next open.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DC_UNION_MAX 256			// Memoized views per cache
+
+/**
+ * Drop a memo's reference, its entry is freed once no context uses it
+ */
+static void dc_union_drop(dc_union_t& u) {
+	dc_retire(u.dent);
+	dc_release(u.dent);
+}
+
+/**
+ * Merge the sorted listings in parts, the first (or with last_wins, the
+ * last) of each name shadowing the rest. Returns an unreferenced entry
+ */
+static dirent_t* dc_union_build(dircache_t* cache, const std::string& key,
+	const std::vector<dirent_t*>& parts, bool last_wins) {
+	std::vector<std::pair<const dirent*, size_t>> all;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		if (!parts[i])
+			continue;
+		for (auto& e : parts[i]->entries)
+			all.emplace_back(&e, i);
+	}
+	// Stable, so equal names stay in path order
+	std::stable_sort(all.begin(), all.end(), [](const auto& a, const auto& b) {
+		return strcmp(a.first->d_name, b.first->d_name) < 0;
+	});
+	
+	auto* dent = new dirent_t();
+	dent->path = key;
+	dent->hash = dc_hash_path(key);
+	dent->nref.store(0);
+	dent->stale.store(false);
+	dent->version = dc_next_version();
+	dent->gen = cache->generation.load();
+	dent->cache = cache;
+	dent->addedat.store(dc_get_time());
+	for (size_t i = 0; i < all.size(); ++i) {
+		bool dup_next = i + 1 < all.size() && !strcmp(all[i].first->d_name, all[i + 1].first->d_name);
+		bool dup_prev = i > 0 && !strcmp(all[i].first->d_name, all[i - 1].first->d_name);
+		if (last_wins ? dup_next : dup_prev)
+			continue; // Shadowed
+		dent->entries.push_back(*all[i].first);
+		dent->entries.back().d_off = dent->entries.size();
+	}
+	return dent;
+}
+
+/**
+ * Returns a referenced union view of paths, reusing the memo if none of
+ * them changed since it was built
+ */
+static dirent_t* dc_union_acquire(dircache_t* cache, const char* const* paths, int n, int mode) {
+	std::string key = std::to_string(mode);
+	std::vector<dirent_t*> parts(n);
+	std::vector<uint64_t> versions(n);
+	bool any = false;
+	for (int i = 0; i < n; ++i) {
+		char fixed[PATH_MAX];
+		dc_fix_path(paths[i], fixed);
+		key += '\0';
+		key += fixed;
+		parts[i] = dc_acquire(cache, fixed);
+		versions[i] = parts[i] ? parts[i]->version : 0;
+		any |= parts[i] != nullptr;
+	}
+	
+	dirent_t* out = nullptr;
+	if (any) {
+		std::unique_lock<std::mutex> lock(cache->unionlock);
+		auto it = cache->unions.find(key);
+		if (it != cache->unions.end() && it->second.versions == versions) {
+			out = it->second.dent;
+			dc_ref(out);
+		}
+		else {
+			lock.unlock();
+			out = dc_union_build(cache, key, parts, mode == DIRCACHE_UNION_LAST_WINS);
+			out->nref.store(2); // Memo and caller
+			lock.lock();
+			auto [it, inserted] = cache->unions.insert({key, {}});
+			if (!inserted)
+				dc_union_drop(it->second);
+			else if (cache->unions.size() > DC_UNION_MAX) {
+				auto victim = cache->unions.begin() != it ? cache->unions.begin() : std::next(it);
+				dc_union_drop(victim->second);
+				cache->unions.erase(victim);
+			}
+			it->second = {out, std::move(versions)};
+		}
+	}
+	for (auto* part : parts) {
+		if (part)
+			dc_release(part);
+	}
+	if (!out)
+		errno = ENOENT;
+	return out;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Search paths
+//  Resolves which directory of a registered list has a name first with one
+//  hash lookup. Whenever a member directory is (re)published, the table is
+//  patched by merge-diffing its old and new listings.
+////////////////////////////////////////////////////////////////////////////////
+
+static bool dc_is_dot(const char* name) {
+	return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+/**
+ * Point name at the first member from index from on that has it, or drop it. Writers only
+ */
+static void dc_search_reresolve(dc_search_path_t* sp, std::string_view name, int from) {
+	auto it = sp->first.find(name);
+	std::string key(name);
+	for (int j = from; j < (int)sp->dents.size(); ++j) {
+		if (sp->dents[j] && dc_lookup_name(sp->dents[j], key.c_str())) {
+			it->second = j;
+			return;
+		}
+	}
+	auto storage = sp->names.find(key);
+	sp->first.erase(it);
+	sp->names.erase(storage);
+}
+
+static void dc_search_add(dc_search_path_t* sp, const char* name, int i) {
+	auto it = sp->first.find(name);
+	if (it == sp->first.end()) {
+		auto storage = sp->names.emplace(name).first;
+		sp->first.emplace(*storage, i);
+	}
+	else if (it->second > i)
+		it->second = i;
+}
+
+/**
+ * Swap in a new listing for member i and patch the table with the names it
+ * gained or lost. Linear in the size of both listings, which are sorted.
+ */
+static void dc_search_update(dc_search_path_t* sp, int i, dirent_t* fresh) {
+	sp->lock.write_lock();
+	auto* old = sp->dents[i];
+	if (old && old->version >= fresh->version) {
+		sp->lock.unlock(); // Already have this one, or newer
+		return;
+	}
+	dc_ref(fresh);
+	sp->dents[i] = fresh;
+	
+	static const std::vector<dirent> none;
+	auto& a = old ? old->entries : none;
+	auto& b = fresh->entries;
+	size_t x = 0, y = 0;
+	while (x < a.size() || y < b.size()) {
+		int c = x == a.size() ? 1 : y == b.size() ? -1 : strcmp(a[x].d_name, b[y].d_name);
+		if (c < 0) {
+			// Removed, the next member that has it takes over
+			if (!dc_is_dot(a[x].d_name)) {
+				auto it = sp->first.find(a[x].d_name);
+				if (it != sp->first.end() && it->second == i)
+					dc_search_reresolve(sp, a[x].d_name, i + 1);
+			}
+			x++;
+		}
+		else if (c > 0) {
+			if (!dc_is_dot(b[y].d_name))
+				dc_search_add(sp, b[y].d_name, i);
+			y++;
+		}
+		else {
+			x++;
+			y++;
+		}
+	}
+	sp->lock.unlock();
+	if (old)
+		dc_release(old);
+}
+
+/**
+ * Called whenever a listing is published, patches search paths it's a member of
+ */
+static void dc_search_notify(dirent_t* dent) {
+	auto* cache = dent->cache;
+	if (!cache->nsearchpaths.load(std::memory_order_relaxed))
+		return;
+	std::lock_guard<std::mutex> lock(cache->searchlock);
+	auto it = cache->searchdirs.find(dent->path);
+	if (it == cache->searchdirs.end())
+		return;
+	for (auto [id, i] : it->second)
+		dc_search_update(cache->searchpaths[id].load(), i, dent);
+}
+
+/**
+ * Shortest TTL among the members of sp, -1 if none of them expire
+ */
+static double dc_search_ttl(dc_search_path_t* sp) {
+	double ttl = -1;
+	AutoReadLock lock(sp->lock);
+	for (auto* dent : sp->dents) {
+		if (dent && dent->mount->validate.load() != DIRCACHE_VALIDATE_NONE) {
+			double t = dent->mount->ttl_ms.load();
+			ttl = ttl < 0 || t < ttl ? t : ttl;
+		}
+	}
+	return ttl;
+}
+
+/**
+ * Revalidate the members of sp if the shortest TTL among them has passed,
+ * or the cache was invalidated. Changes come back through dc_search_notify.
+ * Only one caller does this at a time, the rest keep using the table.
+ */
+static void dc_search_check(dircache_t* cache, dc_search_path_t* sp) {
+	uint64_t gen = cache->generation.load(std::memory_order_relaxed);
+	double ttl = sp->recheck_ms.load(std::memory_order_relaxed);
+	if (sp->gen.load(std::memory_order_relaxed) == gen && ttl < 0)
+		return;
+	double now = dc_get_time();
+	double checked = sp->checked_at.load(std::memory_order_relaxed);
+	if (sp->gen.load(std::memory_order_relaxed) == gen && now - checked <= ttl)
+		return;
+	if (!sp->checked_at.compare_exchange_strong(checked, now))
+		return; // Someone else is on it
+	sp->gen.store(gen);
+	for (auto& dir : sp->dirs) {
+		if (auto* dent = dc_acquire(cache, dir.c_str()))
+			dc_release(dent);
+	}
+	sp->recheck_ms.store(dc_search_ttl(sp)); // Picks up policy changes
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Listing diffs
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Net changes to dent since version, folded from its change log into out.
+ * Returns false if the log doesn't reach back that far
+ */
+static bool dc_diff_since(const dirent_t* dent, uint64_t version, std::vector<dc_change_t>& out) {
+	if (version == dent->version)
+		return true;
+	size_t k = 0;
+	while (k < dent->history.size() && dent->history[k]->from != version)
+		k++;
+	if (k == dent->history.size())
+		return false;
+	
+	// Only the state before the first change and after the last one matter
+	struct net_t {
+		bool before, after;
+		unsigned char old_type, new_type;
+		ino_t old_ino, new_ino;
+	};
+	std::map<std::string_view, net_t> net;
+	for (; k < dent->history.size(); ++k) {
+		for (auto& c : dent->history[k]->changes) {
+			auto [it, inserted] = net.insert({c.name, {}});
+			auto& n = it->second;
+			if (inserted) {
+				n.before = c.kind != DIRCACHE_ADDED;
+				n.old_type = c.old_type;
+				n.old_ino = c.old_ino;
+			}
+			n.after = c.kind != DIRCACHE_REMOVED;
+			n.new_type = c.new_type;
+			n.new_ino = c.new_ino;
+		}
+	}
+	for (auto& [name, n] : net) {
+		if (!n.before && n.after)
+			out.push_back({DIRCACHE_ADDED, std::string(name), DT_UNKNOWN, n.new_type, 0, n.new_ino});
+		else if (n.before && !n.after)
+			out.push_back({DIRCACHE_REMOVED, std::string(name), n.old_type, DT_UNKNOWN, n.old_ino, 0});
+		else if (n.before && (n.old_type != n.new_type || n.old_ino != n.new_ino))
+			out.push_back({DIRCACHE_CHANGED, std::string(name), n.old_type, n.new_type, n.old_ino, n.new_ino});
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Snapshots
+//  A snapshot sees every listing as of the version counter when it began.
+//  While any are active, a refresh keeps the replaced listing linked from
+//  the new one, and the snapshot walks back to the newest one that isn't
+//  too new for it. Links no active snapshot needs are cut when one ends.
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Returns a referenced listing of path as of the snapshot, pinning it so
+ * later reads through the snapshot see the same one
+ */
+static dirent_t* dc_snapshot_acquire(dircache_snapshot_t* snap, const char* path) {
+	{
+		std::lock_guard<std::mutex> lock(snap->lock);
+		auto it = snap->pinned.find(path);
+		if (it != snap->pinned.end()) {
+			dc_ref(it->second);
+			return it->second;
+		}
+	}
+	
+	auto* cache = snap->cache;
+	auto* dent = dc_db_get(cache, path, dc_hash_path(path));
+	if (!dent) {
+		dent = dc_acquire(cache, path); // Wasn't cached, read it now
+		if (!dent)
+			return nullptr;
+	}
+	else if (dent->version > snap->version) {
+		// Refreshed since the snapshot began, find what it replaced
+		std::lock_guard<std::mutex> lock(cache->snaplock);
+		auto* old = dent->prev;
+		while (old && old->version > snap->version)
+			old = old->prev;
+		if (old) {
+			dc_ref(old);
+			dc_release(dent);
+			dent = old;
+		}
+	}
+	
+	std::lock_guard<std::mutex> lock(snap->lock);
+	auto [it, inserted] = snap->pinned.insert({path, dent});
+	if (inserted)
+		dc_ref(dent); // The pin's own
+	else {
+		// Another reader of this snapshot got there first
+		dc_release(dent);
+		dent = it->second;
+		dc_ref(dent);
+	}
+	return dent;
+}
+
+/**
+ * Cut prev links that no active snapshot can reach anymore
+ */
+static void dc_snapshot_trim(dircache_t* cache) {
+	std::vector<dirent_t*> cut;
+	{
+		AutoEpoch epoch;
+		std::lock_guard<std::mutex> lock(cache->snaplock);
+		bool any = !cache->snapversions.empty();
+		uint64_t oldest = any ? *cache->snapversions.begin() : 0;
+		auto* t = dir_db(cache).load(std::memory_order_acquire);
+		for (size_t i = 0; i < t->ngroups * DC_GROUP_SIZE; ++i) {
+			auto* dent = t->slots[i].load(std::memory_order_acquire);
+			if (!dent || dent == DC_SLOT_MOVED)
+				continue;
+			// The oldest snapshot needs at most the newest version that isn't too new for it
+			auto* x = dent;
+			while (any && x && x->version > oldest)
+				x = x->prev;
+			if (x && x->prev) {
+				cut.push_back(x->prev);
+				x->prev = nullptr;
+			}
+		}
+	}
+	for (auto* dent : cut)
+		dc_release(dent);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Cold tier
+//  Listings nobody has looked up for a while are swapped for a copy that
+//  keeps them packed: names front coded against the previous (sorted) one,
+//  then the type and the inode as a zigzag varint delta. A lookup that
+//  finds a cold entry swaps it back for an unpacked copy. Both swaps are
+//  copy-on-write like a refresh, but keep the version since nothing changed.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DC_COLD_SCAN_MS 1000	// Longest time between looks for idle listings
+
+static void dc_put_varint(std::string& out, uint64_t v) {
+	while (v >= 0x80) {
+		out.push_back((char)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((char)v);
+}
+
+static uint64_t dc_get_varint(const char*& p) {
+	uint64_t v = 0;
+	for (int shift = 0;; shift += 7) {
+		uint8_t b = *p++;
+		v |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80))
+			return v;
+	}
+}
+
+/**
+ * New unpublished, unreferenced entry with everything but the listing copied from dent
+ */
+static dirent_t* dc_copy_shell(const dirent_t* dent) {
+	auto* copy = new dirent_t();
+	copy->hash = dent->hash;
+	copy->path = dent->path;
+	copy->addedat.store(dent->addedat.load());
+	copy->stale.store(false);
+	copy->version = dent->version;
+	copy->gen = dent->gen;
+	copy->mount = dent->mount;
+	copy->cache = dent->cache;
+	copy->prefetched.store(dent->prefetched.load());
+	copy->nref.store(0);
+	copy->accesses.store(dent->accesses.load(std::memory_order_relaxed));
+	copy->usedat.store(dent->usedat.load(std::memory_order_relaxed));
+	copy->st = dent->st;
+	copy->depth = dent->depth;
+	copy->history = dent->history;
+	copy->wd = dent->wd;
+	copy->wdgen = dent->wdgen;
+	copy->wdovf = dent->wdovf;
+	dc_inotify_hold(copy->wd);
+	copy->spilled = dent->spilled;
+	return copy;
+}
+
+/**
+ * Append the packed form of a sorted listing to out
+ */
+static void dc_pack_listing(const std::vector<dirent>& entries, std::string& out) {
+	dc_put_varint(out, entries.size());
+	const char* last = "";
+	uint64_t lastino = 0;
+	for (auto& e : entries) {
+		size_t shared = 0;
+		while (last[shared] && last[shared] == e.d_name[shared])
+			shared++;
+		size_t len = strlen(e.d_name + shared);
+		dc_put_varint(out, shared);
+		dc_put_varint(out, len);
+		out.append(e.d_name + shared, len);
+		out.push_back((char)e.d_type);
+		int64_t delta = (int64_t)(e.d_ino - lastino);
+		dc_put_varint(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+		last = e.d_name;
+		lastino = e.d_ino;
+	}
+}
+
+/**
+ * Rebuild a listing from its packed form. Offsets are positions, as for an index listing
+ */
+static void dc_unpack_listing(const char* p, std::vector<dirent>& entries) {
+	size_t n = dc_get_varint(p);
+	entries.resize(n);
+	const char* last = "";
+	uint64_t lastino = 0;
+	for (size_t i = 0; i < n; ++i) {
+		auto& e = entries[i];
+		memset(&e, 0, sizeof(e));
+		size_t shared = dc_get_varint(p);
+		size_t len = dc_get_varint(p);
+		memcpy(e.d_name, last, shared);
+		memcpy(e.d_name + shared, p, len);
+		p += len;
+		e.d_type = (uint8_t)*p++;
+		uint64_t zz = dc_get_varint(p);
+		e.d_ino = lastino + (uint64_t)((int64_t)(zz >> 1) ^ -(int64_t)(zz & 1));
+		e.d_off = i + 1;
+		e.d_reclen = (offsetof(dirent, d_name) + shared + len + 1 + 7) & ~7;
+		last = e.d_name;
+		lastino = e.d_ino;
+	}
+}
+
+static dirent_t* dc_pack(const dirent_t* dent) {
+	auto* cold = dc_copy_shell(dent);
+	cold->cold = true;
+	dc_pack_listing(dent->entries, cold->packed);
+	cold->packed.shrink_to_fit();
+	return cold;
+}
+
+static dirent_t* dc_unpack(const dirent_t* cold) {
+	auto* warm = dc_copy_shell(cold);
+	dc_unpack_listing(cold->packed.data(), warm->entries);
+	return warm;
+}
+
+/**
+ * Put fresh in dent's slot, as the same version of the same listing.
+ * Older versions kept for snapshots move over with it. On success dent is
+ * retired, otherwise the slot has moved on and nothing changes.
+ */
+static bool dc_swap(dirent_t* fresh, dirent_t* dent) {
+	auto* cache = dent->cache;
+	bool swapped = false;
+	{
+		// Held across the swap, so nobody sees fresh without the links yet
+		std::lock_guard<std::mutex> lock(cache->snaplock);
+		AutoEpoch epoch;
+		for (;;) {
+			std::atomic<dirent_t*>* slot = nullptr;
+			auto* t = dir_db(cache).load(std::memory_order_acquire);
+			auto* cur = dc_table_find(t, dent->path.c_str(), dent->hash, &slot);
+			if (cur != dent)
+				break;
+			if (slot->compare_exchange_strong(cur, fresh)) {
+				fresh->prev = dent->prev;
+				dent->prev = nullptr;
+				swapped = true;
+				break;
+			}
+			if (cur != DC_SLOT_MOVED)
+				break; // Otherwise frozen by a rehash just now, look again in the new table
+		}
+	}
+	if (swapped)
+		dc_retire(dent);
+	return swapped;
+}
+
+/**
+ * Swap a referenced cold entry for an unpacked copy. Returns the copy,
+ * referenced, or nullptr if dent was replaced meanwhile. dent's reference
+ * is consumed either way.
+ */
+static dirent_t* dc_thaw(dirent_t* dent) {
+	auto* cache = dent->cache;
+	auto* warm = dc_unpack(dent);
+	warm->nref.store(1);
+	bool swapped = dc_swap(warm, dent);
+	dc_release(dent);
+	if (!swapped) {
+		dc_free_ent(warm);
+		return nullptr;
+	}
+	cache->thaws++;
+	return warm;
+}
+
+/**
+ * Pack the listings of cache that have been idle for its cold_after_ms.
+ * Called by the reclaimer, which only looks every so often. Listings with
+ * open handles are left alone, packing them would free nothing.
+ * Returns how many were packed.
+ */
+static size_t dc_pack_idle(dircache_t* cache) {
+	double after = cache->cold_after_ms.load(std::memory_order_relaxed);
+	double now = dc_reclaimer().now.load(std::memory_order_relaxed);
+	if (after <= 0 || now - cache->coldscan < std::min(after, (double)DC_COLD_SCAN_MS))
+		return 0;
+	cache->coldscan = now;
+	
+	uint64_t gen = cache->generation.load();
+	size_t packed = 0;
+	AutoEpoch epoch;
+	auto* t = dir_db(cache).load(std::memory_order_acquire);
+	for (size_t i = 0; i < t->ngroups * DC_GROUP_SIZE; ++i) {
+		auto* dent = t->slots[i].load(std::memory_order_acquire);
+		if (!dent || dent == DC_SLOT_MOVED || dent->cold || dent->gen != gen
+			|| now - dent->usedat.load(std::memory_order_relaxed) < after
+			|| dc_refs(dent) != 0 || dent->refreshing.load())
+			continue;
+		// Anyone who grabs it meanwhile just keeps the unpacked one
+		auto* cold = dc_pack(dent);
+		if (!dc_swap(cold, dent)) {
+			dc_free_ent(cold);
+			continue;
+		}
+		cache->packs++;
+		packed++;
+	}
+	return packed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Spill tier
+//  With a memory budget, the reclaimer evicts the least recently used
+//  listings without open handles whenever the cache is over it. With a
+//  spill dir as well, evicted listings are first appended, packed, to
+//  segment files on local disk, and a later miss reads them back from there
+//  instead of the filesystem. Restored listings keep their stat baseline and
+//  age, so they're revalidated just as if they had stayed cached, except
+//  that their inotify watch went with the evicted entry and stat is used.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DC_EVICT_SCAN_MS 1000		// How often the reclaimer checks the budget
+#define DC_ADMIT_PRESSURE 8			// Admission filters once within 1/this of the budget
+
+static void dc_sketch_fit(dircache_t* cache, size_t live);
+static int dc_sketch_frequency(dircache_t* cache, size_t hash);
+#define DC_SPILL_SEGMENT (64 << 20)	// Bytes appended to a spill file before starting another
+
+/**
+ * Rough heap footprint of an entry
+ */
+static size_t dc_ent_bytes(const dirent_t* dent) {
+	return sizeof(dirent_t) + dent->path.capacity() + dent->entries.capacity() * sizeof(dirent)
+		+ dent->packed.capacity();
+}
+
+/**
+ * Make a new, already unlinked, spill file in dir
+ */
+static int dc_spill_open(const std::string& dir) {
+	int fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+		return fd;
+	// Filesystem without O_TMPFILE
+	std::string tmpl = dir + "/dircache-spill-XXXXXX";
+	fd = mkostemp(&tmpl[0], O_CLOEXEC);
+	if (fd >= 0)
+		unlink(tmpl.c_str());
+	return fd;
+}
+
+/**
+ * Account for a record leaving the index. Segments nothing refers to anymore
+ * are closed, unless still being appended to. Spill lock held for writing
+ */
+static void dc_spill_unref(dc_spill_t& sp, const dc_spill_rec_t& rec) {
+	auto it = sp.segs.find(rec.seg);
+	it->second.live -= rec.len;
+	if (!it->second.live && rec.seg != sp.active) {
+		close(it->second.fd);
+		sp.segs.erase(it);
+	}
+}
+
+/**
+ * Close every spill file and forget what was in them. Both spill locks held
+ */
+static void dc_spill_clear(dc_spill_t& sp) {
+	for (auto& p : sp.segs)
+		close(p.second.fd);
+	sp.segs.clear();
+	sp.index.clear();
+	sp.active = -1;
+}
+
+/**
+ * Forget records from before an invalidation, they'd only be reloaded anyway
+ */
+static void dc_spill_drop_old(dc_spill_t& sp, uint64_t gen) {
+	std::lock_guard<std::mutex> wlock(sp.writelock);
+	if (sp.gen == gen)
+		return;
+	sp.lock.write_lock();
+	for (auto it = sp.index.begin(); it != sp.index.end();) {
+		if (it->second.gen < gen) {
+			dc_spill_unref(sp, it->second);
+			it = sp.index.erase(it);
+		}
+		else
+			++it;
+	}
+	sp.gen = gen;
+	sp.lock.unlock();
+}
+
+/**
+ * Append the listing of dent, which is about to be evicted, to the spill
+ * files. Returns false if spilling is off or the write failed
+ */
+static bool dc_spill_write(dircache_t* cache, const dirent_t* dent) {
+	auto& sp = cache->spill;
+	std::lock_guard<std::mutex> wlock(sp.writelock);
+	if (!sp.enabled.load())
+		return false;
+	if (dent->spilled) {
+		// Restored from there and not changed since, unless the record is gone
+		AutoReadLock lock(sp.lock);
+		auto it = sp.index.find(dent->path);
+		if (it != sp.index.end() && it->second.gen == dent->gen)
+			return true;
+	}
+	
+	std::string buf;
+	if (dent->cold)
+		buf = dent->packed;
+	else
+		dc_pack_listing(dent->entries, buf);
+	
+	// Segments are only added or appended to under writelock, so no need for lock to look
+	if (sp.segs.at(sp.active).size + buf.size() > DC_SPILL_SEGMENT) {
+		int fd = dc_spill_open(sp.dir);
+		if (fd < 0)
+			return false;
+		sp.lock.write_lock();
+		int full = sp.active;
+		sp.active = sp.nextseg++;
+		sp.segs[sp.active] = {fd, 0, 0};
+		if (!sp.segs[full].live) {
+			close(sp.segs[full].fd);
+			sp.segs.erase(full);
+		}
+		sp.lock.unlock();
+	}
+	auto& seg = sp.segs.at(sp.active);
+	if (pwrite(seg.fd, buf.data(), buf.size(), seg.size) != (ssize_t)buf.size())
+		return false;
+	dc_spill_rec_t rec = {sp.active, seg.size, (uint32_t)buf.size(), dent->gen, dent->addedat.load(),
+		dent->st, dent->mount, dent->accesses.load(std::memory_order_relaxed)};
+	seg.size += buf.size();
+	
+	sp.lock.write_lock();
+	seg.live += rec.len;
+	auto [it, inserted] = sp.index.try_emplace(dent->path, rec);
+	if (!inserted) {
+		dc_spill_unref(sp, it->second);
+		it->second = rec;
+	}
+	sp.lock.unlock();
+	sp.writes++;
+	return true;
+}
+
+/**
+ * Bring path back from the spill files, if it was evicted there. Returns the
+ * published entry, referenced and revalidated if it has expired meanwhile,
+ * or nullptr if there's nothing to restore
+ */
+static dirent_t* dc_spill_restore(dircache_t* cache, const char* path) {
+	auto& sp = cache->spill;
+	if (!sp.enabled.load(std::memory_order_relaxed))
+		return nullptr;
+	dc_spill_rec_t rec;
+	std::string buf;
+	{
+		AutoReadLock lock(sp.lock);
+		auto it = sp.index.find(path);
+		if (it == sp.index.end() || it->second.gen != cache->generation.load())
+			return nullptr;
+		rec = it->second;
+		buf.resize(rec.len);
+		if (pread(sp.segs.at(rec.seg).fd, &buf[0], rec.len, rec.off) != (ssize_t)rec.len)
+			return nullptr;
+	}
+	
+	auto* dent = new dirent_t();
+	dent->cache = cache;
+	dent->path = path;
+	dent->hash = dc_hash_path(dent->path);
+	dent->nref.store(0);
+	dent->stale.store(false);
+	dent->version = 0;
+	dent->gen = rec.gen;
+	dent->st = rec.st;
+	dent->mount = rec.mount;
+	dent->addedat.store(rec.addedat);
+	dent->usedat.store(dc_get_time());
+	dent->accesses.store(rec.accesses);
+	dent->spilled = true;
+	dc_unpack_listing(buf.data(), dent->entries);
+	sp.hits++;
+	
+	dent = dc_publish(dent);
+	if (dc_is_expired(dent))
+		return dc_revalidate(dent, false);
+	return dent;
+}
+
+/**
+ * Take dent out of the table, unless it's been replaced meanwhile
+ */
+static bool dc_table_remove(dirent_t* dent) {
+	auto* cache = dent->cache;
+	bool removed = false;
+	dir_db_lock(cache).write_lock();
+	auto* t = dir_db(cache).load(std::memory_order_relaxed);
+	std::atomic<dirent_t*>* slot = nullptr;
+	auto* cur = dc_table_find(t, dent->path.c_str(), dent->hash, &slot);
+	// CAS so a concurrent refresh of this slot wins
+	if (cur == dent && slot->compare_exchange_strong(cur, nullptr)) {
+		__atomic_store_n(&t->ctrl[slot - t->slots], DC_CTRL_DELETED, __ATOMIC_RELEASE);
+		t->live--;
+		removed = true;
+	}
+	dir_db_lock(cache).unlock();
+	return removed;
+}
+
+/**
+ * If cache is over its memory budget, evict least recently used listings
+ * until it isn't. Called by the reclaimer, which only checks every so often.
+ * Returns how many were evicted.
+ */
+static size_t dc_evict_over_budget(dircache_t* cache) {
+	size_t budget = cache->mem_budget.load(std::memory_order_relaxed);
+	double now = dc_reclaimer().now.load(std::memory_order_relaxed);
+	if (!budget || now - cache->evictscan < DC_EVICT_SCAN_MS)
+		return 0;
+	cache->evictscan = now;
+	uint64_t gen = cache->generation.load();
+	dc_spill_drop_old(cache->spill, gen);
+	
+	AutoEpoch epoch;
+	size_t total = 0, live = 0;
+	std::vector<std::pair<double, dirent_t*>> idle;
+	auto* t = dir_db(cache).load(std::memory_order_acquire);
+	for (size_t i = 0; i < t->ngroups * DC_GROUP_SIZE; ++i) {
+		auto* dent = t->slots[i].load(std::memory_order_acquire);
+		if (!dent || dent == DC_SLOT_MOVED)
+			continue;
+		total += dc_ent_bytes(dent);
+		live++;
+		// Older generations are swept anyway, and evicting opened ones frees nothing
+		if (dent->gen == gen && dc_refs(dent) == 0 && !dent->refreshing.load())
+			idle.push_back({dent->usedat.load(std::memory_order_relaxed), dent});
+	}
+	dc_sketch_fit(cache, live);
+	if (total <= budget - budget / DC_ADMIT_PRESSURE) {
+		cache->admit_over.store(-1);
+		return 0;
+	}
+	
+	std::sort(idle.begin(), idle.end());
+	size_t evicted = 0, next = 0;
+	for (; next < idle.size() && total > budget; ++next) {
+		auto* dent = idle[next].second;
+		if (dc_refs(dent))
+			continue; // Opened since
+		dc_spill_write(cache, dent);
+		if (!dc_table_remove(dent))
+			continue;
+		dc_retire(dent);
+		total -= dc_ent_bytes(dent);
+		evicted++;
+	}
+	cache->evictions += evicted;
+	
+	// Near the budget, a new listing has to be more popular than the next one out
+	int victim = next < idle.size() ? dc_sketch_frequency(cache, idle[next].second->hash) : -1;
+	cache->admit_over.store(victim);
+	return evicted;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Admission filter
+//  TinyLFU: every lookup is counted in a count-min sketch, and every
+//  10 * width lookups the reclaimer halves all counts so popularity fades. Once the
+//  cache nears its memory budget, a listing read on a miss is only
+//  published if the sketch has seen it more often than the listing that
+//  eviction would drop next. A scan of a big tree looks each directory up
+//  once, so it can't push out the working set.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DC_SKETCH_BATCH 64		// Lookups a thread counts before adding them to samples
+
+static uint64_t dc_sketch_mix(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static std::atomic_uint8_t& dc_sketch_at(const dc_sketch_t* sk, int row, size_t hash) {
+	return sk->counts[row * (sk->mask + 1) + (dc_sketch_mix(hash + row) & sk->mask)];
+}
+
+/**
+ * A sketch width wide. If there's an old one its counts carry over, each
+ * counter becomes every counter of the new row that it covers
+ */
+static dc_sketch_t* dc_sketch_new(size_t width, const dc_sketch_t* old) {
+	auto* sk = new dc_sketch_t;
+	sk->mask = width - 1;
+	sk->counts = new std::atomic_uint8_t[DC_SKETCH_ROWS * width];
+	for (size_t i = 0; i < DC_SKETCH_ROWS * width; ++i) {
+		size_t row = i / width;
+		uint8_t c = old ? old->counts[row * (old->mask + 1) + (i & old->mask)].load(std::memory_order_relaxed) : 0;
+		sk->counts[i].store(c, std::memory_order_relaxed);
+	}
+	return sk;
+}
+
+static void dc_sketch_free(void* p) {
+	auto* sk = (dc_sketch_t*)p;
+	delete[] sk->counts;
+	delete sk;
+}
+
+static int dc_sketch_estimate(const dc_sketch_t* sk, size_t hash) {
+	int est = DC_SKETCH_MAX;
+	for (int i = 0; i < DC_SKETCH_ROWS; ++i)
+		est = std::min<int>(est, dc_sketch_at(sk, i, hash).load(std::memory_order_relaxed));
+	return est;
+}
+
+/**
+ * Count a lookup of the path with this hash. Counters are bumped with plain
+ * stores rather than atomic adds, racing lookups may lose a count.
+ */
+static void dc_sketch_record(dircache_t* cache, size_t hash) {
+	if (!cache->admission.load(std::memory_order_relaxed))
+		return;
+	AutoEpoch epoch;
+	auto* sk = cache->sketch.load(std::memory_order_acquire);
+	// Conservative update, only the smallest counters grow so collisions inflate less
+	int est = dc_sketch_estimate(sk, hash);
+	if (est < DC_SKETCH_MAX) {
+		for (int i = 0; i < DC_SKETCH_ROWS; ++i) {
+			auto& c = dc_sketch_at(sk, i, hash);
+			if (c.load(std::memory_order_relaxed) == est)
+				c.store(est + 1, std::memory_order_relaxed);
+		}
+	}
+	
+	thread_local unsigned tick = 0;
+	if (++tick % DC_SKETCH_BATCH == 0)
+		sk->samples.fetch_add(DC_SKETCH_BATCH, std::memory_order_relaxed);
+}
+
+/**
+ * Halve all counts once enough lookups have been counted. Reclaimer only,
+ * so lookups never pay for a pass over the sketch
+ */
+static void dc_sketch_age(dircache_t* cache) {
+	if (!cache->admission.load())
+		return;
+	auto* sk = cache->sketch.load();
+	uint64_t period = 10 * (sk->mask + 1);
+	uint64_t n = sk->samples.load(std::memory_order_relaxed);
+	if (n < period)
+		return;
+	sk->samples.fetch_sub(n - n % period, std::memory_order_relaxed);
+	int shift = std::min<uint64_t>(n / period, 8); // Missed periods each halve too
+	for (size_t i = 0; i < DC_SKETCH_ROWS * (sk->mask + 1); ++i)
+		sk->counts[i].store(sk->counts[i].load(std::memory_order_relaxed) >> shift, std::memory_order_relaxed);
+}
+
+static int dc_sketch_frequency(dircache_t* cache, size_t hash) {
+	if (!cache->admission.load(std::memory_order_relaxed))
+		return -1;
+	AutoEpoch epoch;
+	return dc_sketch_estimate(cache->sketch.load(std::memory_order_acquire), hash);
+}
+
+/**
+ * Whether a listing read on a miss should go into the db
+ */
+static bool dc_sketch_admits(dircache_t* cache, size_t hash) {
+	int over = cache->admit_over.load(std::memory_order_relaxed);
+	if (over < 0 || !cache->admission.load(std::memory_order_relaxed))
+		return true;
+	if (dc_sketch_frequency(cache, hash) > over)
+		return true;
+	cache->rejects++;
+	return false;
+}
+
+/**
+ * Hand a listing that wasn't admitted to its caller without putting it in
+ * the db. It's freed like a replaced entry once the caller is done with it
+ */
+static dirent_t* dc_unlisted(dirent_t* dent) {
+	dent->version = dc_next_version();
+	dent->nref.store(1);
+	dc_retire(dent);
+	return dent;
+}
+
+/**
+ * Widen the sketch to keep up with the number of cached listings. Reclaimer only
+ */
+static void dc_sketch_fit(dircache_t* cache, size_t live) {
+	if (!cache->admission.load())
+		return;
+	auto* sk = cache->sketch.load();
+	size_t width = sk->mask + 1;
+	if (live * 2 <= width)
+		return;
+	while (width < live * 4)
+		width *= 2;
+	cache->sketch.store(dc_sketch_new(width, sk), std::memory_order_release);
+	dc_epoch_retire(sk, dc_sketch_free);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Public implementation
+////////////////////////////////////////////////////////////////////////////////
+
+// Create a cache instance
+dircache_t* dircache_create(const dircache_config_t* config) {
+	auto* cache = new dircache_t;
+	cache->db.store(dc_table_new(64));
+	cache->fd_budget.store(config && config->fd_budget >= 0 ? config->fd_budget : 128);
+	cache->max_populates.store(config && config->max_populates >= 0 ? config->max_populates : 32);
+	if (config && config->cold_after_ms > 0)
+		dircache_set_cold_after_in(cache, config->cold_after_ms);
+	if (config && config->mem_budget)
+		dircache_set_memory_budget_in(cache, config->mem_budget);
+	if (config && config->admission)
+		dircache_set_admission_in(cache, 1);
+	dc_policy_defaults(cache->policies);
+	
+	auto& r = dc_reclaimer();
+	std::lock_guard<std::mutex> lock(r.reglock);
+	r.caches.push_back(cache);
+	return cache;
+}
+
+// Destroy a cache instance, all of its handles must be closed
+void dircache_destroy(dircache_t* cache) {
+	if (!cache || cache == dircache_default())
+		return;
+	{
+		// Also waits out a reclaimer pass that may be using it
+		auto& r = dc_reclaimer();
+		std::lock_guard<std::mutex> lock(r.reglock);
+		r.caches.erase(std::find(r.caches.begin(), r.caches.end(), cache));
+	}
+	
+	// Timed loads stuck on a hung mount may never come back, so don't wait on
+	// them. The last one to finish frees the cache instead.
+	cache->destroying.store(true);
+	if (cache->timed_loaders.load() == 0 && !cache->torn_down.exchange(true))
+		dc_teardown(cache);
+}
+
+/**
+ * Free everything a destroyed cache owns, once nothing can be using it
+ */
+static void dc_teardown(dircache_t* cache) {
+	// Background refreshes hold references, let them land
+	while (cache->nbackground.load())
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	
+	dir_db_lock(cache).write_lock();
+	auto* t = dir_db(cache).load(std::memory_order_relaxed);
+	std::vector<dirent_t*> dead;
+	for (size_t i = 0; i < t->ngroups * DC_GROUP_SIZE; ++i) {
+		auto* dent = t->slots[i].exchange(DC_SLOT_MOVED);
+		if (dent && dent != DC_SLOT_MOVED)
+			dead.push_back(dent);
+	}
+	dir_db_lock(cache).unlock();
+	for (auto* dent : dead)
+		dc_retire(dent);
+	for (auto& p : cache->unions)
+		dc_union_drop(p.second);
+	for (int i = 0; i < cache->nsearchpaths.load(); ++i) {
+		auto* sp = cache->searchpaths[i].load();
+		for (auto* dent : sp->dents) {
+			if (dent)
+				dc_release(dent);
+		}
+		delete sp;
+	}
+	while (dc_purge_stale(cache, true)) {
+		// Freeing an entry lets go of the older versions it kept
+	}
+	dc_epoch_retire(t, dc_table_free);
+	dc_spill_clear(cache->spill);
+	if (auto* sk = cache->sketch.load())
+		dc_epoch_retire(sk, dc_sketch_free);
+	
+	// Entries still in the epoch's retire lists don't point at their mount or cache anymore
+	for (auto& p : cache->policies.mounts)
+		delete p.second;
+	delete[] cache->trace.rows.load();
+	delete cache;
+}
+
+// The instance used by the plain dircache_ functions
+dircache_t* dircache_default() {
+	static dircache_t* cache = dircache_create(nullptr); // The reclaimer may outlive statics
+	return cache;
+}
+
+// Invalidate all entries
+void dircache_invalidate_in(dircache_t* cache) {
+	// Constant time, old entries are reloaded lazily and swept in the background
+	cache->generation.fetch_add(1);
+	dc_reclaim_kick(cache, true);
+}
+
+void dircache_invalidate() {
+	dircache_invalidate_in(dircache_default());
+}
+
+// Tunables
+void dircache_set_ttl_in(dircache_t* cache, double ms) {
+	dircache_policy_t policy;
+	dircache_get_fs_policy_in(cache, 0, &policy);
+	policy.ttl_ms = ms > 0 ? ms : 0;
+	policy.validate = ms > 0 ? DIRCACHE_VALIDATE_STAT : DIRCACHE_VALIDATE_NONE;
+	dircache_set_fs_policy_in(cache, 0, &policy);
+}
+
+void dircache_set_ttl(double ms) {
+	dircache_set_ttl_in(dircache_default(), ms);
+}
+
+void dircache_set_fs_policy_in(dircache_t* cache, long f_type, const dircache_policy_t* policy) {
+	auto& table = cache->policies;
+	std::lock_guard<std::mutex> lock(table.lock);
+	table.policies[f_type] = *policy;
+	// Update mounts already using this policy, including ones falling back to the default
+	for (auto& p : table.mounts) {
+		auto* mount = p.second;
+		if (mount->ftype == f_type || (f_type == 0 && !table.policies.count(mount->ftype)))
+			dc_mount_apply(mount, *policy);
+	}
+}
+
+void dircache_set_fs_policy(long f_type, const dircache_policy_t* policy) {
+	dircache_set_fs_policy_in(dircache_default(), f_type, policy);
+}
+
+int dircache_get_fs_policy_in(dircache_t* cache, long f_type, dircache_policy_t* policy) {
+	auto& table = cache->policies;
+	std::lock_guard<std::mutex> lock(table.lock);
+	auto it = table.policies.find(f_type);
+	if (it == table.policies.end())
+		it = table.policies.find(0);
+	*policy = it->second;
+	return 0;
+}
+
+int dircache_get_fs_policy(long f_type, dircache_policy_t* policy) {
+	return dircache_get_fs_policy_in(dircache_default(), f_type, policy);
+}
+
+void dircache_set_fd_budget_in(dircache_t* cache, int n) {
+	cache->fd_budget.store(n < 0 ? 0 : n);
+	std::lock_guard<std::mutex> lock(cache->fdpool.lock);
+	dc_fd_trim(cache);
+}
+
+void dircache_set_fd_budget(int n) {
+	dircache_set_fd_budget_in(dircache_default(), n);
+}
+
+void dircache_set_max_populates_in(dircache_t* cache, int n) {
+	cache->max_populates.store(n < 0 ? 0 : n);
+	dc_admit_retry(cache->admit, cache->max_populates); // Limit may have been raised
+}
+
+void dircache_set_max_populates(int n) {
+	dircache_set_max_populates_in(dircache_default(), n);
+}
+
+// Cold tier threshold
+void dircache_set_cold_after_in(dircache_t* cache, double ms) {
+	cache->cold_after_ms.store(ms < 0 ? 0 : ms);
+	if (ms > 0)
+		dc_reclaim_kick(cache, false); // Packing is done by the reclaimer
+}
+
+void dircache_set_cold_after(double ms) {
+	dircache_set_cold_after_in(dircache_default(), ms);
+}
+
+// Memory budget and spill tier
+void dircache_set_memory_budget_in(dircache_t* cache, size_t bytes) {
+	cache->mem_budget.store(bytes);
+	if (bytes)
+		dc_reclaim_kick(cache, false); // Eviction is done by the reclaimer
+}
+
+void dircache_set_memory_budget(size_t bytes) {
+	dircache_set_memory_budget_in(dircache_default(), bytes);
+}
+
+int dircache_set_spill_dir_in(dircache_t* cache, const char* dir) {
+	auto& sp = cache->spill;
+	std::lock_guard<std::mutex> wlock(sp.writelock);
+	int fd = -1;
+	if (dir && (fd = dc_spill_open(dir)) < 0)
+		return -1;
+	sp.lock.write_lock();
+	dc_spill_clear(sp);
+	sp.enabled.store(dir != nullptr);
+	if (dir) {
+		sp.dir = dir;
+		sp.active = sp.nextseg++;
+		sp.segs[sp.active] = {fd, 0, 0};
+	}
+	sp.lock.unlock();
+	return 0;
+}
+
+int dircache_set_spill_dir(const char* dir) {
+	return dircache_set_spill_dir_in(dircache_default(), dir);
+}
+
+// Frequency based admission
+void dircache_set_admission_in(dircache_t* cache, int enabled) {
+	if (enabled && !cache->sketch.load()) {
+		dc_sketch_t* none = nullptr;
+		auto* sk = dc_sketch_new(DC_SKETCH_MIN_WIDTH, nullptr);
+		if (!cache->sketch.compare_exchange_strong(none, sk))
+			dc_sketch_free(sk);
+	}
+	cache->admission.store(enabled != 0);
+}
+
+void dircache_set_admission(int enabled) {
+	dircache_set_admission_in(dircache_default(), enabled);
+}
+
+void dircache_set_prefetch_in(dircache_t* cache, const dircache_prefetch_t* config) {
+	auto& pf = cache->prefetch;
+	pf.max_fanout.store(config->max_fanout);
+	pf.max_depth.store(config->max_depth);
+	pf.max_queued.store(config->max_queued);
+	pf.min_hit_ratio.store(config->min_hit_ratio);
+	pf.off_until.store(0);
+	pf.enabled.store(config->enabled);
+}
+
+void dircache_set_prefetch(const dircache_prefetch_t* config) {
+	dircache_set_prefetch_in(dircache_default(), config);
+}
+
+void dircache_set_trace_prefetch_in(dircache_t* cache, int enabled) {
+	auto& tr = cache->trace;
+	if (enabled && !tr.rows.load()) {
+		dc_trace_row_t* none = nullptr;
+		auto* rows = new dc_trace_row_t[DC_TRACE_ROWS];
+		if (!tr.rows.compare_exchange_strong(none, rows))
+			delete[] rows;
+	}
+	tr.enabled.store(enabled);
+}
+
+void dircache_set_trace_prefetch(int enabled) {
+	dircache_set_trace_prefetch_in(dircache_default(), enabled);
+}
+
+// Counters
+int dircache_get_stats_in(dircache_t* cache, dircache_stats_t* stats) {
+	auto& pf = cache->prefetch;
+	stats->populates = cache->populates.load();
+	stats->prefetch_issued = pf.issued.load();
+	stats->prefetch_hits = pf.hits.load();
+	stats->prefetch_paused = cache->populates.load() < pf.off_until.load();
+	stats->trace_issued = cache->trace.issued.load();
+	stats->trace_hits = cache->trace.hits.load();
+	stats->trace_accuracy = stats->trace_issued ? (double)stats->trace_hits / stats->trace_issued : 0;
+	stats->cold_packs = cache->packs.load();
+	stats->cold_thaws = cache->thaws.load();
+	stats->evictions = cache->evictions.load();
+	stats->spill_writes = cache->spill.writes.load();
+	stats->spill_hits = cache->spill.hits.load();
+	stats->admission_rejects = cache->rejects.load();
+	return 0;
+}
+
+int dircache_get_stats(dircache_stats_t* stats) {
+	return dircache_get_stats_in(dircache_default(), stats);
+}
+
+// Build an offline index file
+int dircache_build_index(const char* root, const char* file) {
+	char fixed[PATH_MAX];
+	if (!realpath(root, fixed))
+		return -1;
+	int rootfd = open(fixed, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (rootfd < 0)
+		return -1;
+	std::vector<dc_build_dir_t> dirs;
+	int r = dc_build_walk(rootfd, "", dirs);
+	close(rootfd);
+	if (r != 0)
+		return -1;
+	
+	std::sort(dirs.begin(), dirs.end(), [](const dc_build_dir_t& a, const dc_build_dir_t& b) {
+		return strcmp(a.rel.c_str(), b.rel.c_str()) < 0;
+	});
+	
+	// Lay out: header, dir table, strings, then per dir offset table + records
+	auto align8 = [](std::string& buf) { buf.resize((buf.size() + 7) & ~(size_t)7, '\0'); };
+	std::string buf(sizeof(dc_index_header_t) + sizeof(dc_index_dir_t) * dirs.size(), '\0');
+	dc_index_header_t hdr = {};
+	memcpy(hdr.magic, DC_INDEX_MAGIC, sizeof(DC_INDEX_MAGIC));
+	hdr.version = DC_INDEX_VERSION;
+	hdr.ndirs = dirs.size();
+	hdr.dirs_off = sizeof(dc_index_header_t);
+	hdr.root_off = buf.size();
+	buf.append(fixed, strlen(fixed) + 1);
+	
+	std::vector<dc_index_dir_t> table(dirs.size());
+	for (size_t i = 0; i < dirs.size(); ++i) {
+		table[i].path_off = buf.size();
+		buf.append(dirs[i].rel.c_str(), dirs[i].rel.size() + 1);
+	}
+	for (size_t i = 0; i < dirs.size(); ++i) {
+		align8(buf);
+		table[i].nents = dirs[i].recs.size();
+		table[i].ents_off = buf.size();
+		uint64_t off = buf.size() + sizeof(uint64_t) * dirs[i].recs.size();
+		for (auto& rec : dirs[i].recs) {
+			buf.append((const char*)&off, sizeof(off));
+			off += rec.size();
+		}
+		for (auto& rec : dirs[i].recs)
+			buf.append(rec);
+	}
+	hdr.size = buf.size();
+	memcpy(&buf[0], &hdr, sizeof(hdr));
+	memcpy(&buf[hdr.dirs_off], table.data(), sizeof(dc_index_dir_t) * table.size());
+	
+	// Write to a temp file and rename so readers never see a partial index
+	std::string tmp = std::string(file) + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "wb");
+	if (!fp)
+		return -1;
+	bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok || rename(tmp.c_str(), file) != 0) {
+		unlink(tmp.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+// Write the most used directories out, hottest first
+int dircache_dump_hotset_in(dircache_t* cache, const char* file, int max) {
+	std::vector<std::pair<uint64_t, std::string>> hot;
+	{
+		AutoEpoch epoch;
+		auto* t = dir_db(cache).load(std::memory_order_acquire);
+		for (size_t i = 0; i < t->ngroups * DC_GROUP_SIZE; ++i) {
+			auto* dent = t->slots[i].load(std::memory_order_acquire);
+			if (!dent || dent == DC_SLOT_MOVED)
+				continue;
+			uint64_t n = dent->accesses.load(std::memory_order_relaxed);
+			// One path per line, so names with newlines can't be stored
+			if (n && dent->path.find('\n') == std::string::npos)
+				hot.emplace_back(n, dent->path);
+		}
+	}
+	size_t n = max > 0 ? std::min(hot.size(), (size_t)max) : hot.size();
+	std::partial_sort(hot.begin(), hot.begin() + n, hot.end(), [](const auto& a, const auto& b) {
+		return a.first > b.first;
+	});
+	
+	// Write to a temp file and rename so readers never see a partial hot set
+	std::string tmp = std::string(file) + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "w");
+	if (!fp)
+		return -1;
+	bool ok = fprintf(fp, DC_HOTSET_MAGIC "\n") > 0;
+	for (size_t i = 0; i < n && ok; ++i)
+		ok = fprintf(fp, "%llu %s\n", (unsigned long long)hot[i].first, hot[i].second.c_str()) > 0;
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok || rename(tmp.c_str(), file) != 0) {
+		unlink(tmp.c_str());
+		return -1;
+	}
+	return n;
+}
+
+int dircache_dump_hotset(const char* file, int max) {
+	return dircache_dump_hotset_in(dircache_default(), file, max);
+}
+
+// Populate the directories in a hot set file on nthreads threads
+int dircache_warm_from_hotset_in(dircache_t* cache, const char* file, int nthreads) {
+	FILE* fp = fopen(file, "r");
+	if (!fp)
+		return -1;
+	std::vector<std::pair<uint64_t, std::string>> hot;
+	char* line = nullptr;
+	size_t cap = 0;
+	ssize_t len = getline(&line, &cap, fp);
+	bool ok = len > 0 && !strcmp(line, DC_HOTSET_MAGIC "\n");
+	while (ok && (len = getline(&line, &cap, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = 0;
+		char* path;
+		unsigned long long n = strtoull(line, &path, 10);
+		if (*path == ' ' && path[1] == '/')
+			hot.emplace_back(n, path + 1);
+	}
+	free(line);
+	fclose(fp);
+	if (!ok) {
+		errno = EINVAL;
+		return -1;
+	}
+	
+	// Hottest first, each thread takes the next path in line
+	std::atomic_size_t next {0};
+	std::atomic_int warmed {0};
+	auto worker = [&] {
+		for (size_t i; (i = next.fetch_add(1)) < hot.size();) {
+			auto* dent = dc_acquire(cache, hot[i].second.c_str());
+			if (!dent)
+				continue; // Gone since the dump
+			dent->accesses.fetch_add(hot[i].first, std::memory_order_relaxed);
+			dc_release(dent);
+			warmed++;
+		}
+	};
+	std::vector<std::thread> threads;
+	try {
+		for (int i = 1; i < nthreads; ++i)
+			threads.emplace_back(worker);
+	}
+	catch (const std::system_error&) {
+		// Couldn't start them all, the rest of the list is warmed here
+	}
+	worker();
+	for (auto& t : threads)
+		t.join();
+	return warmed.load();
+}
+
+int dircache_warm_from_hotset(const char* file, int nthreads) {
+	return dircache_warm_from_hotset_in(dircache_default(), file, nthreads);
+}
+
+/**
+ * Whether a string at off ends within the first size bytes of base
+ */
+static bool dc_index_str_ok(const char* base, size_t size, uint64_t off) {
+	return off < size && memchr(base + off, 0, size - off);
+}
+
+/**
+ * Check that every offset in a mapped index stays inside it, so a
+ * truncated or corrupt file can't send lookups or readdir off the end
+ */
+static bool dc_index_check(const char* base, size_t size) {
+	auto* hdr = (const dc_index_header_t*)base;
+	if (hdr->dirs_off % alignof(dc_index_dir_t) || hdr->dirs_off > size
+		|| hdr->ndirs > (size - hdr->dirs_off) / sizeof(dc_index_dir_t))
+		return false;
+	if (!dc_index_str_ok(base, size, hdr->root_off))
+		return false;
+	auto* dirs = (const dc_index_dir_t*)(base + hdr->dirs_off);
+	for (uint32_t i = 0; i < hdr->ndirs; ++i) {
+		auto& dir = dirs[i];
+		if (!dc_index_str_ok(base, size, dir.path_off))
+			return false;
+		if (dir.ents_off % alignof(uint64_t) || dir.ents_off > size
+			|| dir.nents > (size - dir.ents_off) / sizeof(uint64_t))
+			return false;
+		auto* offs = (const uint64_t*)(base + dir.ents_off);
+		for (uint64_t j = 0; j < dir.nents; ++j) {
+			uint64_t off = offs[j];
+			if (off % alignof(dirent) || off > size || size - off < offsetof(dirent, d_name))
+				return false;
+			auto* e = (const dirent*)(base + off);
+			if (e->d_reclen <= offsetof(dirent, d_name) || e->d_reclen > size - off
+				|| !memchr(e->d_name, 0, e->d_reclen - offsetof(dirent, d_name)))
+				return false;
+		}
+	}
+	return true;
+}
+
+// Map an offline index and serve its tree from it
+int dircache_load_index(const char* file) {
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(dc_index_header_t)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+	
+	auto* hdr = (const dc_index_header_t*)base;
+	if (memcmp(hdr->magic, DC_INDEX_MAGIC, sizeof(DC_INDEX_MAGIC)) || hdr->version != DC_INDEX_VERSION
+		|| hdr->size != (uint64_t)st.st_size || !dc_index_check((const char*)base, st.st_size)) {
+		munmap(base, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+	
+	auto* idx = new dc_index_t;
+	idx->base = (const char*)base;
+	idx->size = st.st_size;
+	idx->hdr = hdr;
+	idx->dirs = (const dc_index_dir_t*)(idx->base + hdr->dirs_off);
+	idx->root = idx->base + hdr->root_off;
+	idx->rootlen = strlen(idx->root);
+	
+	static std::mutex lock; // Serializes loaders only
+	std::lock_guard<std::mutex> guard(lock);
+	int n = dc_nindexes.load();
+	if (n >= DC_MAX_INDEXES) {
+		munmap(base, st.st_size);
+		delete idx;
+		errno = ENOSPC;
+		return -1;
+	}
+	dc_indexes[n].store(idx, std::memory_order_release);
+	dc_nindexes.store(n + 1, std::memory_order_release);
+	return 0;
+}
+
+/**
+ * Look up the last component of path in its parent's listing. Returns 1
+ * with its d_type in type if it's there, 0 if not, and -1 if the parent
+ * couldn't be listed for some other reason than not being a directory
+ * (say it's search-only), which says nothing about the entry
+ */
+static int dc_exists_type(dircache_t* cache, const char* path, unsigned char* type) {
+	char fixed[PATH_MAX];
+	dc_fix_path(path, fixed);
+	
+	// Split into parent and basename
+	char* slash = strrchr(fixed, '/');
+	const char* parent = ".";
+	const char* name = fixed;
+	if (slash == fixed) {
+		if (!slash[1]) {
+			*type = DT_DIR;
+			return 1; // "/" always exists
+		}
+		parent = "/";
+		name = slash + 1;
+	}
+	else if (slash) {
+		*slash = 0;
+		parent = fixed;
+		name = slash + 1;
+	}
+	
+	// . and .. are in every listing so these fall out naturally
+	const dc_index_dir_t* idir;
+	const char* ibase;
+	const dirent* e;
+	switch (dc_index_find(parent, &idir, &ibase)) {
+	case 1:
+		if (!(e = dc_index_lookup_name(idir, ibase, name)))
+			return 0;
+		*type = e->d_type;
+		return 1;
+	case 0: return 0;
+	}
+	
+	auto* dent = dc_acquire(cache, parent);
+	if (!dent)
+		return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+	dc_count_access(dent);
+	e = dc_lookup_name(dent, name);
+	if (e)
+		*type = e->d_type;
+	dc_release(dent);
+	return e != nullptr;
+}
+
+// Existence check answered from the parent listing
+int dircache_exists_in(dircache_t* cache, const char* path) {
+	unsigned char type;
+	int found = dc_exists_type(cache, path, &type);
+	if (found >= 0)
+		return found;
+	// Like the listing, a dangling symlink still exists
+	struct stat st;
+	return fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+int dircache_exists(const char* path) {
+	return dircache_exists_in(dircache_default(), path);
+}
+
+// access(2)
+int dircache_access_in(dircache_t* cache, const char* path, int mode) {
+	if (mode != F_OK)
+		return access(path, mode);
+	unsigned char type;
+	int found = dc_exists_type(cache, path, &type);
+	if (found < 0)
+		return access(path, mode);
+	if (!found) {
+		errno = ENOENT;
+		return -1;
+	}
+	// Symlinks may dangle, and unknown types may not be directories
+	if (type == DT_LNK || type == DT_UNKNOWN)
+		return access(path, mode);
+	size_t len = strlen(path);
+	if (type != DT_DIR && len > 1 && path[len - 1] == '/') {
+		errno = ENOTDIR;
+		return -1;
+	}
+	return 0;
+}
+
+int dircache_access(const char* path, int mode) {
+	return dircache_access_in(dircache_default(), path, mode);
+}
+
+// readdir(3)
+dirent* dircache_readdir(dircontext_t* dir) {
+	if (dir->pos >= dc_ctx_size(dir))
+		return nullptr;
+	return dc_ctx_at(dir, dir->pos++);
+}
+
+// opendir(3)
+dircontext_t* dircache_opendir_in(dircache_t* cache, const char* path) {
+	char fixed[PATH_MAX]; // Correct any bad slashes
+	dc_fix_path(path, fixed);
+	const dc_index_dir_t* idir;
+	const char* ibase;
+	switch (dc_index_find(fixed, &idir, &ibase)) {
+	case 1: return dc_build_around_index(idir, ibase);
+	case 0: errno = ENOENT; return nullptr;
+	}
+	return dc_find_or_populate(cache, fixed);
+}
+
+dircontext_t* dircache_opendir(const char* path) {
+	return dircache_opendir_in(dircache_default(), path);
+}
+
+// opendir(3) that gives up on hung filesystems
+dircontext_t* dircache_opendir_timeout_in(dircache_t* cache, const char* path, double ms) {
+	char fixed[PATH_MAX];
+	dc_fix_path(path, fixed);
+	const dc_index_dir_t* idir;
+	const char* ibase;
+	switch (dc_index_find(fixed, &idir, &ibase)) {
+	case 1: return dc_build_around_index(idir, ibase);
+	case 0: errno = ENOENT; return nullptr;
+	}
+	auto* dent = dc_acquire_timeout(cache, fixed, ms);
+	if (!dent)
+		return nullptr;
+	dc_count_access(dent);
+	dc_trace_record(dent);
+	auto* ctx = dc_build_around_ent(dent);
+	dc_release(dent);
+	return ctx;
+}
+
+dircontext_t* dircache_opendir_timeout(const char* path, double ms) {
+	return dircache_opendir_timeout_in(dircache_default(), path, ms);
+}
+
+// rewinddir(3)
+void dircache_rewinddir(dircontext_t* dir) {
+	dir->pos = 0;
+}
+
+// telldir(3)
+long dircache_telldir(dircontext_t* dir) {
+	return dir->pos;
+}
+
+// seekdir(3)
+void dircache_seekdir(dircontext_t* dir, long loc) {
+	if (loc < 0 || (size_t)loc >= dc_ctx_size(dir))
+		return;
+	dir->pos = loc;
+}
+
+// closedir(3)
+void dircache_closedir(dircontext_t* dir) {
+	dc_close(dir);
+}
+
+// scandir(3)
+int dircache_scandir_in(dircache_t* cache,
+	const char* dirp,
+	struct dirent*** namelist,
+	int (*filter)(const struct dirent*),
+	int (*compare)(const struct dirent**,
+		const struct dirent**)) {
+	
+	auto ctx = dircache_opendir_in(cache, dirp);
+	if (!ctx)
+		return -1;
+		
+	// Accumulate entries into a list -- This is not quite optimal. Should determine the number of ents first
+	size_t count = dc_ctx_size(ctx);
+	*namelist = (dirent**)calloc(count, sizeof(dirent*));
+	int n = 0;
+	for (size_t i = 0; i < count; ++i) {
+		auto* e = dc_ctx_at(ctx, i);
+		if (filter && !filter(e))
+			continue;
+	#ifdef DIRCACHE_DROPIN
+		// Index records are only as long as their name, so don't copy past it
+		auto* p = calloc(1, sizeof(dirent));
+		memcpy(p, e, offsetof(dirent, d_name) + strlen(e->d_name) + 1);
+		(*namelist)[n++] = (dirent*)p;
+	#else
+		(*namelist)[n++] = e;
+	#endif
+	}
+	
+	// Resultant list sorted with qsort, as specified by POSIX standard
+	if (n && compare)
+		qsort(*namelist, n, sizeof(dirent*), (comparison_fn_t)compare);
+	
+	dc_close(ctx);
+	return n;
+}
+
+int dircache_scandir(const char* dirp,
+	struct dirent*** namelist,
+	int (*filter)(const struct dirent*),
+	int (*compare)(const struct dirent**,
+		const struct dirent**)) {
+	return dircache_scandir_in(dircache_default(), dirp, namelist, filter, compare);
+}
+
+// scandir(3) with a built-in filter instead of a callback
+int dircache_scandir_filtered_in(dircache_t* cache,
+	const char* dirp,
+	struct dirent*** namelist,
+	const dircache_filter_t* filter,
+	int (*compare)(const struct dirent**,
+		const struct dirent**)) {
+	
+	auto ctx = dircache_opendir_in(cache, dirp);
+	if (!ctx)
+		return -1;
+	
+	size_t count = dc_ctx_size(ctx);
+	std::vector<uint8_t> pass(count, 1);
+	if (filter && ctx->ent)
+		dc_filter_eval(filter, ctx->ent, pass.data());
+	else if (filter) {
+		for (size_t i = 0; i < count; ++i)
+			pass[i] = dc_filter_match(filter, dc_ctx_at(ctx, i));
+	}
+	
+	*namelist = (dirent**)calloc(count, sizeof(dirent*));
+	int n = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (!pass[i])
+			continue;
+		auto* e = dc_ctx_at(ctx, i);
+	#ifdef DIRCACHE_DROPIN
+		auto* p = calloc(1, sizeof(dirent));
+		memcpy(p, e, offsetof(dirent, d_name) + strlen(e->d_name) + 1);
+		(*namelist)[n++] = (dirent*)p;
+	#else
+		(*namelist)[n++] = e;
+	#endif
+	}
+	
+	if (n && compare)
+		qsort(*namelist, n, sizeof(dirent*), (comparison_fn_t)compare);
+	
+	dc_close(ctx);
+	return n;
+}
+
+int dircache_scandir_filtered(const char* dirp,
+	struct dirent*** namelist,
+	const dircache_filter_t* filter,
+	int (*compare)(const struct dirent**,
+		const struct dirent**)) {
+	return dircache_scandir_filtered_in(dircache_default(), dirp, namelist, filter, compare);
+}
+
+// Merged view of several directories
+dircontext_t* dircache_open_union_in(dircache_t* cache, const char* const* paths, int n, int mode) {
+	auto* dent = dc_union_acquire(cache, paths, n, mode);
+	if (!dent)
+		return nullptr;
+	auto* ctx = dc_build_around_ent(dent);
+	dc_release(dent);
+	return ctx;
+}
+
+dircontext_t* dircache_open_union(const char* const* paths, int n, int mode) {
+	return dircache_open_union_in(dircache_default(), paths, n, mode);
+}
+
+// Register a search path for dircache_resolve
+int dircache_add_search_path_in(dircache_t* cache, const char* const* dirs, int n) {
+	auto* sp = new dc_search_path_t;
+	for (int i = 0; i < n; ++i) {
+		char fixed[PATH_MAX];
+		dc_fix_path(dirs[i], fixed);
+		sp->dirs.push_back(fixed);
+	}
+	sp->dents.resize(n);
+	sp->gen.store(cache->generation.load());
+	sp->checked_at.store(dc_get_time());
+	
+	int id;
+	{
+		std::lock_guard<std::mutex> lock(cache->searchlock);
+		id = cache->nsearchpaths.load();
+		if (id == DC_MAX_SEARCH_PATHS) {
+			delete sp;
+			errno = ENOSPC;
+			return -1;
+		}
+		for (int i = 0; i < n; ++i)
+			cache->searchdirs[sp->dirs[i]].emplace_back(id, i);
+		cache->searchpaths[id].store(sp);
+		cache->nsearchpaths.store(id + 1);
+	}
+	
+	// Registered first so no repopulate from here on is missed
+	for (int i = 0; i < n; ++i) {
+		if (auto* dent = dc_acquire(cache, sp->dirs[i].c_str())) {
+			dc_search_update(sp, i, dent);
+			dc_release(dent);
+		}
+	}
+	sp->recheck_ms.store(dc_search_ttl(sp));
+	return id;
+}
+
+int dircache_add_search_path(const char* const* dirs, int n) {
+	return dircache_add_search_path_in(dircache_default(), dirs, n);
+}
+
+// Which directory of a search path has name first
+int dircache_resolve_in(dircache_t* cache, int search_path_id, const char* name) {
+	if (search_path_id < 0 || search_path_id >= cache->nsearchpaths.load()) {
+		errno = EINVAL;
+		return -1;
+	}
+	auto* sp = cache->searchpaths[search_path_id].load();
+	dc_search_check(cache, sp);
+	AutoReadLock lock(sp->lock);
+	auto it = sp->first.find(name);
+	return it != sp->first.end() ? it->second : -1;
+}
+
+int dircache_resolve(int search_path_id, const char* name) {
+	return dircache_resolve_in(dircache_default(), search_path_id, name);
+}
+
+// Changes to a directory since a version of its listing
+int dircache_diff_in(dircache_t* cache, const char* path, uint64_t since_version,
+	dircache_change_fn fn, void* arg, uint64_t* version) {
+	char fixed[PATH_MAX];
+	dc_fix_path(path, fixed);
+	auto* dent = dc_acquire(cache, fixed);
+	if (!dent)
+		return -1;
+	
+	std::vector<dc_change_t> changes;
+	if (since_version == 0) {
+		// Everything is new
+		for (auto& e : dent->entries) {
+			if (!dc_is_dot(e.d_name))
+				changes.push_back({DIRCACHE_ADDED, e.d_name, DT_UNKNOWN, e.d_type, 0, e.d_ino});
+		}
+	}
+	else if (!dc_diff_since(dent, since_version, changes)) {
+		dc_release(dent);
+		errno = ESTALE;
+		return -1;
+	}
+	if (version)
+		*version = dent->version;
+	dc_release(dent);
+	
+	for (auto& c : changes) {
+		dircache_change_t change = {c.kind, c.name.c_str(), c.old_type, c.new_type, c.old_ino, c.new_ino};
+		fn(&change, arg);
+	}
+	return changes.size();
+}
+
+int dircache_diff(const char* path, uint64_t since_version,
+	dircache_change_fn fn, void* arg, uint64_t* version) {
+	return dircache_diff_in(dircache_default(), path, since_version, fn, arg, version);
+}
+
+// Consistent multi-directory reads
+dircache_snapshot_t* dircache_snapshot_begin_in(dircache_t* cache) {
+	auto* snap = new dircache_snapshot_t;
+	snap->cache = cache;
+	std::lock_guard<std::mutex> lock(cache->snaplock);
+	// Counted first, so any refresh that gets a later version links its predecessor
+	cache->nsnapshots++;
+	snap->version = dc_version().load();
+	cache->snapversions.insert(snap->version);
+	return snap;
+}
+
+dircache_snapshot_t* dircache_snapshot_begin() {
+	return dircache_snapshot_begin_in(dircache_default());
+}
+
+dircontext_t* dircache_snapshot_opendir(dircache_snapshot_t* snap, const char* path) {
+	char fixed[PATH_MAX];
+	dc_fix_path(path, fixed);
+	const dc_index_dir_t* idir;
+	const char* ibase;
+	switch (dc_index_find(fixed, &idir, &ibase)) {
+	case 1: return dc_build_around_index(idir, ibase); // Never changes anyway
+	case 0: errno = ENOENT; return nullptr;
+	}
+	auto* dent = dc_snapshot_acquire(snap, fixed);
+	if (!dent)
+		return nullptr;
+	dc_count_access(dent);
+	auto* ctx = dc_build_around_ent(dent);
+	dc_release(dent);
+	return ctx;
+}
+
+void dircache_snapshot_end(dircache_snapshot_t* snap) {
+	auto* cache = snap->cache;
+	for (auto& p : snap->pinned)
+		dc_release(p.second);
+	{
+		std::lock_guard<std::mutex> lock(cache->snaplock);
+		cache->snapversions.erase(cache->snapversions.find(snap->version));
+		cache->nsnapshots--;
+	}
+	delete snap;
+	dc_snapshot_trim(cache);
+}
+
+// glob(3)
+int dircache_glob_path_in(dircache_t* cache, const char* pattern, int flags, glob_t* pglob) {
+	// These need glob's own machinery
+	if (flags & (GLOB_ALTDIRFUNC | GLOB_BRACE | GLOB_TILDE | GLOB_TILDE_CHECK))
+		return glob(pattern, flags, nullptr, pglob);
+	
+	if (!(flags & GLOB_APPEND)) {
+		pglob->gl_pathc = 0;
+		pglob->gl_pathv = nullptr;
+		if (!(flags & GLOB_DOOFFS))
+			pglob->gl_offs = 0;
+	}
+	
+	std::vector<std::string> found;
+	int r = dc_glob(cache, pattern, flags, found);
+	if (r)
+		return r;
+	if (found.empty()) {
+		if (!(flags & GLOB_NOCHECK) && !((flags & GLOB_NOMAGIC) && !dc_glob_has_magic(pattern, flags)))
+			return GLOB_NOMATCH;
+		found.emplace_back(pattern);
+	}
+	else if (!(flags & GLOB_NOSORT)) {
+		std::sort(found.begin(), found.end(), [](const std::string& a, const std::string& b) {
+			return strcoll(a.c_str(), b.c_str()) < 0;
+		});
+	}
+	
+	// Laid out the way globfree(3) expects
+	size_t offs = pglob->gl_offs;
+	size_t old = pglob->gl_pathc;
+	auto** v = (char**)realloc(pglob->gl_pathv, (offs + old + found.size() + 1) * sizeof(char*));
+	if (!v)
+		return GLOB_NOSPACE;
+	if (!pglob->gl_pathv) {
+		for (size_t i = 0; i < offs; ++i)
+			v[i] = nullptr;
+	}
+	for (size_t i = 0; i < found.size(); ++i)
+		v[offs + old + i] = strdup(found[i].c_str());
+	v[offs + old + found.size()] = nullptr;
+	pglob->gl_pathv = v;
+	pglob->gl_pathc = old + found.size();
+	pglob->gl_flags = flags;
+	return 0;
+}
+
+int dircache_glob_path(const char* pattern, int flags, glob_t* pglob) {
+	return dircache_glob_path_in(dircache_default(), pattern, flags, pglob);
 }
 
 void dircache_freelist(struct dirent** namelist, int n) {
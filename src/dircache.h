@@ -1,16 +1,280 @@
 #pragma once
 
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/dir.h>
+#include <glob.h>
 
 struct dircontext_t;
+struct dircache_t;
+struct dircache_snapshot_t;
+
+/**
+ * How cached entries are checked once their TTL passes
+ */
+enum dircache_validate_t {
+	DIRCACHE_VALIDATE_NONE = 0,	// Never expire
+	DIRCACHE_VALIDATE_TTL,		// Reread unconditionally
+	DIRCACHE_VALIDATE_STAT,		// Reread only if the directory's mtime/ctime changed
+	DIRCACHE_VALIDATE_INOTIFY,	// Reread only if an inotify event arrived, falls back to STAT
+};
+
+/**
+ * Cache behavior for all directories on a given filesystem type
+ */
+struct dircache_policy_t {
+	double ttl_ms;			// Age after which entries are validated. 0 validates on every access
+	int validate;			// One of dircache_validate_t
+	int stat_prefetch;		// Fill in DT_UNKNOWN entries with fstatat at populate time
+	int max_concurrent;		// Max concurrent populates per mount. 0 is unlimited
+	double max_stale_ms;	// Serve expired entries for up to this long past ttl_ms while
+							// they're refreshed in the background. Older ones block. 0 always blocks
+};
+
+/**
+ * Settings for a new cache instance
+ */
+struct dircache_config_t {
+	int fd_budget;			// Max pooled directory fds, see dircache_set_fd_budget
+	int max_populates;		// Max concurrent directory reads, see dircache_set_max_populates
+	double cold_after_ms;	// Pack listings idle this long, see dircache_set_cold_after
+	size_t mem_budget;		// Bytes of listings to keep, see dircache_set_memory_budget
+	int admission;			// Filter new listings by frequency, see dircache_set_admission
+};
+
+/**
+ * @brief Create an independent cache instance
+ * Each instance has its own db, locks, fd pool, budgets and policies, so
+ * instances never contend with or evict each other. Offline indexes loaded
+ * with dircache_load_index are shared by all instances.
+ * config may be NULL for the defaults.
+ */
+dircache_t* dircache_create(const dircache_config_t* config);
+
+/**
+ * @brief Destroy an instance made by dircache_create
+ * All handles opened from it must be closed first. The default instance
+ * is never destroyed.
+ */
+void dircache_destroy(dircache_t* cache);
+
+/**
+ * @brief The instance used by all functions without an _in suffix
+ */
+dircache_t* dircache_default();
 
 /**
  * Invalidates all internal cache data
  * Call this when you want to force a refresh of the tree
+ * This is constant time: entries are reloaded on their next lookup and old
+ * ones are freed in the background once no open handle uses them.
  */
 void dircache_invalidate();
+void dircache_invalidate_in(dircache_t* cache);
+
+/**
+ * Built-in scandir filter, evaluated without a callback per entry.
+ * An entry passes if it matches every part that is set:
+ * its type is in type_mask, its extension (text after the last '.', without
+ * the dot) is one of extensions, and its name starts with one of prefixes.
+ * An empty string in extensions matches names without an extension.
+ */
+struct dircache_filter_t {
+	const char* const* extensions;
+	int nextensions;
+	const char* const* prefixes;
+	int nprefixes;
+	unsigned int type_mask;		// DIRCACHE_TYPE_BIT(DT_xxx) | ..., 0 for any
+};
+
+#define DIRCACHE_TYPE_BIT(t) (1u << (t))
+
+/**
+ * @brief Set the age in ms after which cached entries are revalidated
+ * Revalidation compares the directory's stat against the one taken at populate
+ * time and only rereads the directory if it changed. 0 (default) disables this.
+ * This only applies to filesystems without their own policy, see dircache_set_fs_policy
+ */
+void dircache_set_ttl(double ms);
+void dircache_set_ttl_in(dircache_t* cache, double ms);
+
+/**
+ * @brief Set the policy for directories on filesystems with the given statfs f_type
+ * f_type 0 is the fallback for filesystems without an entry. tmpfs, ext4, xfs,
+ * btrfs, NFS and FUSE have built in defaults. Mounts already in use pick up the change.
+ */
+void dircache_set_fs_policy(long f_type, const dircache_policy_t* policy);
+void dircache_set_fs_policy_in(dircache_t* cache, long f_type, const dircache_policy_t* policy);
+
+/**
+ * @brief Get the policy that applies to the given statfs f_type
+ */
+int dircache_get_fs_policy(long f_type, dircache_policy_t* policy);
+int dircache_get_fs_policy_in(dircache_t* cache, long f_type, dircache_policy_t* policy);
+
+/**
+ * @brief Set the max number of O_PATH directory fds kept open by the cache
+ * These let revalidation skip the path walk. Least recently used fds are
+ * closed first when over budget. 0 disables the pool. Default is 128.
+ */
+void dircache_set_fd_budget(int n);
+void dircache_set_fd_budget_in(dircache_t* cache, int n);
+
+/**
+ * @brief Set the max number of directories the cache reads at once
+ * Applies on top of each filesystem's max_concurrent. Readers queue in
+ * arrival order, and threads missing on the same directory share a single
+ * read, so load stays flat after dircache_invalidate. 0 is unlimited. Default is 32.
+ */
+void dircache_set_max_populates(int n);
+void dircache_set_max_populates_in(dircache_t* cache, int n);
+
+/**
+ * @brief Pack listings nobody has looked up for ms
+ * Packed listings take a fraction of the memory and are unpacked again
+ * on their next lookup, so only the long tail pays for it. Listings with
+ * open handles stay as they are. 0 disables. Default is 0.
+ */
+void dircache_set_cold_after(double ms);
+void dircache_set_cold_after_in(dircache_t* cache, double ms);
+
+/**
+ * @brief Cap the memory cached listings take
+ * Once over, least recently used listings without open handles are evicted,
+ * checked about once a second. 0 is unlimited. Default is 0.
+ */
+void dircache_set_memory_budget(size_t bytes);
+void dircache_set_memory_budget_in(dircache_t* cache, size_t bytes);
+
+/**
+ * @brief Spill evicted listings to files in dir rather than dropping them
+ * A later miss reads the listing back from there instead of the filesystem,
+ * and revalidates it as if it had stayed cached. dir should be on fast local
+ * storage. The files are unlinked as soon as they're made, so nothing is left
+ * behind. Only matters with a memory budget. NULL stops spilling and forgets
+ * what was spilled.
+ * @returns 0 on success, -1 with errno set if no file can be made in dir
+ */
+int dircache_set_spill_dir(const char* dir);
+int dircache_set_spill_dir_in(dircache_t* cache, const char* dir);
+
+/**
+ * @brief Only cache new listings that are popular enough, once near the memory budget
+ * Lookups are counted in a small frequency sketch whose counts fade over
+ * time. Near the budget, a directory read on a miss is only cached if it's
+ * been looked up more often than the listing that would be evicted for it,
+ * otherwise the caller gets it uncached. A one-off walk of a big tree then
+ * can't flush the working set. Only matters with a memory budget. Default is off.
+ */
+void dircache_set_admission(int enabled);
+void dircache_set_admission_in(dircache_t* cache, int enabled);
+
+/**
+ * Child prefetch settings, see dircache_set_prefetch
+ */
+struct dircache_prefetch_t {
+	int enabled;
+	int max_fanout;			// Max subdirectories queued per directory read
+	int max_depth;			// Levels below a directory opened on demand to prefetch
+	int max_queued;			// Max prefetches waiting or running at once
+	double min_hit_ratio;	// Pause for a while if fewer prefetched entries get used
+};
+
+/**
+ * @brief Prefetch subdirectories of directories read on demand
+ * Their DT_DIR children are populated in the background, so opening them
+ * right after is a cache hit. Off by default.
+ */
+void dircache_set_prefetch(const dircache_prefetch_t* config);
+void dircache_set_prefetch_in(dircache_t* cache, const dircache_prefetch_t* config);
+
+/**
+ * @brief Prefetch directories that usually get opened after the one just opened
+ * Each thread's sequence of dircache_opendir calls is recorded as A -> B
+ * transition counts in a small fixed-size table. Opening A then loads the
+ * B's seen often enough in the background. Shares max_queued with child
+ * prefetch. Off by default.
+ */
+void dircache_set_trace_prefetch(int enabled);
+void dircache_set_trace_prefetch_in(dircache_t* cache, int enabled);
+
+/**
+ * Cache counters, see dircache_get_stats
+ */
+struct dircache_stats_t {
+	unsigned long long populates;		// Directories read on demand
+	unsigned long long prefetch_issued;	// Child prefetches queued
+	unsigned long long prefetch_hits;	// Prefetched directories later opened
+	int prefetch_paused;				// Child prefetch is paused for a low hit ratio
+	unsigned long long trace_issued;	// Directories loaded by trace prefetch
+	unsigned long long trace_hits;		// ... that were then opened
+	double trace_accuracy;				// trace_hits / trace_issued
+	unsigned long long cold_packs;		// Idle listings packed
+	unsigned long long cold_thaws;		// ... and unpacked again by a lookup
+	unsigned long long evictions;		// Listings evicted for the memory budget
+	unsigned long long spill_writes;	// ... written to the spill files
+	unsigned long long spill_hits;		// Misses answered from the spill files
+	unsigned long long admission_rejects;	// Listings read but not admitted
+};
+
+/**
+ * @brief Read the cache's counters
+ */
+int dircache_get_stats(dircache_stats_t* stats);
+int dircache_get_stats_in(dircache_t* cache, dircache_stats_t* stats);
+
+/**
+ * @brief Scan the tree at root once and write a sorted index of it to file
+ * Meant for trees that never change after they're published.
+ * @returns 0 on success, -1 with errno set on error
+ */
+int dircache_build_index(const char* root, const char* file);
+
+/**
+ * @brief Map an index written by dircache_build_index
+ * Afterwards, dircache_opendir/dircache_exists on paths under the indexed root
+ * are answered from the mapping without locks or syscalls. Paths must be given
+ * in the same absolute form as the root was resolved to.
+ * @returns 0 on success, -1 with errno set on error
+ */
+int dircache_load_index(const char* file);
+
+/**
+ * @brief Write the max most accessed cached directories to file, hottest first
+ * The file holds only paths and access counts, no listings. max <= 0 writes all.
+ * @returns the number of paths written, -1 with errno set on error
+ */
+int dircache_dump_hotset(const char* file, int max);
+int dircache_dump_hotset_in(dircache_t* cache, const char* file, int max);
+
+/**
+ * @brief Populate the directories listed in a hot set file using nthreads threads
+ * Meant for startup, to bring the working set back before it's asked for.
+ * Their access counts carry over, so they stay in the next dump.
+ * @returns the number of directories populated, -1 with errno set on error
+ */
+int dircache_warm_from_hotset(const char* file, int nthreads);
+int dircache_warm_from_hotset_in(dircache_t* cache, const char* file, int nthreads);
+
+/**
+ * @brief Checks if path exists, answered from the cached listing of its parent
+ * The parent directory is populated if it isn't cached yet, after which
+ * repeated probes in that directory need no syscalls. If the parent can be
+ * searched but not listed, the entry is stat'ed instead.
+ * @returns 1 if the entry exists, 0 otherwise
+ */
+int dircache_exists(const char* path);
+int dircache_exists_in(dircache_t* cache, const char* path);
+
+/**
+ * @brief Replacement for access. See access(2)
+ * Only F_OK is answered from the cache, other modes go to access(2), as
+ * do symlinks (which may dangle), entries of unknown type and entries of
+ * directories that can't be listed
+ */
+int dircache_access(const char* path, int mode);
+int dircache_access_in(dircache_t* cache, const char* path, int mode);
 
 /**
  * @brief Replacement for readdir. See readdir(3)
@@ -21,6 +285,17 @@ dirent* dircache_readdir(dircontext_t* dir);
  * @brief Replacement for opendir. See opendir(3)
  */
 dircontext_t* dircache_opendir(const char* path);
+dircontext_t* dircache_opendir_in(dircache_t* cache, const char* path);
+
+/**
+ * @brief Like dircache_opendir, but waits at most ms for the filesystem
+ * Reads happen on a separate thread so a hung mount can't hold the caller.
+ * If the deadline passes, the last known listing is returned regardless of
+ * its age, or NULL with errno set to ETIMEDOUT if there is none. The same
+ * goes when too many reads are already stuck, with errno set to EAGAIN.
+ */
+dircontext_t* dircache_opendir_timeout(const char* path, double ms);
+dircontext_t* dircache_opendir_timeout_in(dircache_t* cache, const char* path, double ms);
 
 /** 
  * @brief Reset dircontext to first entry
@@ -50,8 +325,127 @@ void dircache_closedir(dircontext_t* dir);
 int dircache_scandir(const char* dirp, struct dirent*** namelist,
 	int(*filter)(const struct dirent*), 
 	int(*compare)(const struct dirent**, const struct dirent**));
+int dircache_scandir_in(dircache_t* cache, const char* dirp, struct dirent*** namelist,
+	int(*filter)(const struct dirent*),
+	int(*compare)(const struct dirent**, const struct dirent**));
+
+/**
+ * @brief Like dircache_scandir, but with a built-in filter descriptor
+ * Filters are matched over packed name columns kept with the cached listing,
+ * which is much cheaper than calling back for every entry.
+ * filter may be NULL to return everything.
+ */
+int dircache_scandir_filtered(const char* dirp, struct dirent*** namelist,
+	const dircache_filter_t* filter,
+	int(*compare)(const struct dirent**, const struct dirent**));
+int dircache_scandir_filtered_in(dircache_t* cache, const char* dirp, struct dirent*** namelist,
+	const dircache_filter_t* filter,
+	int(*compare)(const struct dirent**, const struct dirent**));
 
 /**
  * @brief Helper to free entry list returned by dircache_scandir
  */
-void dircache_freelist(struct dirent** namelist, int n);
\ No newline at end of file
+void dircache_freelist(struct dirent** namelist, int n);
+
+/**
+ * How dircache_open_union resolves names found in more than one directory
+ */
+enum dircache_union_mode_t {
+	DIRCACHE_UNION_FIRST_WINS = 0,	// Earlier paths shadow later ones, like a search path
+	DIRCACHE_UNION_LAST_WINS,		// Later paths shadow earlier ones, like overlay layers
+};
+
+/**
+ * @brief Open a merged, de-duplicated and sorted listing of several directories
+ * Directories that don't exist are skipped. The view is memoized and rebuilt
+ * whenever any of the directories is repopulated. Read it with dircache_readdir
+ * and close it with dircache_closedir. Fails with ENOENT if none exist.
+ */
+dircontext_t* dircache_open_union(const char* const* paths, int n, int mode);
+dircontext_t* dircache_open_union_in(dircache_t* cache, const char* const* paths, int n, int mode);
+
+/**
+ * @brief Register an ordered list of directories to resolve names against
+ * The directories needn't exist yet. Registrations last as long as the cache.
+ * @returns the id to pass to dircache_resolve, -1 with errno set on error
+ */
+int dircache_add_search_path(const char* const* dirs, int n);
+int dircache_add_search_path_in(dircache_t* cache, const char* const* dirs, int n);
+
+/**
+ * @brief Find the first directory of a search path that contains name
+ * Answered with a single hash lookup. The table behind it is patched
+ * whenever one of the directories is repopulated, and the directories are
+ * revalidated per their filesystem's policy as it's used.
+ * @returns the index of the directory in the registered list, -1 if none has it
+ */
+int dircache_resolve(int search_path_id, const char* name);
+int dircache_resolve_in(dircache_t* cache, int search_path_id, const char* name);
+
+/**
+ * Kinds of change reported by dircache_diff
+ */
+enum dircache_change_kind_t {
+	DIRCACHE_ADDED = 0,
+	DIRCACHE_REMOVED,
+	DIRCACHE_CHANGED,		// Same name, different type or inode
+};
+
+struct dircache_change_t {
+	int kind;				// dircache_change_kind_t
+	const char* name;		// Only valid during the callback
+	unsigned char old_type, new_type;	// DT_xxx, DT_UNKNOWN where it didn't exist
+	ino_t old_ino, new_ino;
+};
+
+typedef void (*dircache_change_fn)(const dircache_change_t* change, void* arg);
+
+/**
+ * @brief Report what changed in a directory since a version of its listing
+ * Calls fn once per added, removed or changed name, sorted by name, with the
+ * net change since since_version. since_version 0 reports every entry as added.
+ * The directory is revalidated per its policy first, and the version of the
+ * listing the changes lead up to is stored in *version, to pass in next time.
+ * A few versions of history are kept; if since_version is older than that
+ * (or the directory was dropped from the cache since) this fails with ESTALE
+ * and the caller should rescan from version 0.
+ * @returns the number of changes reported, -1 with errno set on error
+ */
+int dircache_diff(const char* path, uint64_t since_version,
+	dircache_change_fn fn, void* arg, uint64_t* version);
+int dircache_diff_in(dircache_t* cache, const char* path, uint64_t since_version,
+	dircache_change_fn fn, void* arg, uint64_t* version);
+
+/**
+ * @brief Start a consistent view of the cache
+ * Directories read through the snapshot are seen as they were cached when
+ * it began, even if they're refreshed meanwhile, and the same listing is
+ * returned every time. Others keep getting refreshed listings. Directories
+ * that weren't cached when it began (or were invalidated and swept since)
+ * are read when the snapshot first opens them.
+ * Older listings are kept only while a snapshot may need them.
+ */
+dircache_snapshot_t* dircache_snapshot_begin();
+dircache_snapshot_t* dircache_snapshot_begin_in(dircache_t* cache);
+
+/**
+ * @brief Like dircache_opendir, but reads from the snapshot
+ * Close with dircache_closedir; contexts may outlive the snapshot.
+ */
+dircontext_t* dircache_snapshot_opendir(dircache_snapshot_t* snap, const char* path);
+
+/**
+ * @brief End a snapshot, older listings only it needed are released
+ * All snapshots must be ended before their cache is destroyed.
+ */
+void dircache_snapshot_end(dircache_snapshot_t* snap);
+
+/**
+ * @brief Replacement for glob. See glob(3)
+ * Wildcard components are matched against cached listings, and branches
+ * that fan out into many directories are expanded in parallel.
+ * GLOB_BRACE, GLOB_TILDE and GLOB_ALTDIRFUNC go to glob(3) as is.
+ * Free the result with globfree(3).
+ */
+int dircache_glob_path(const char* pattern, int flags, glob_t* pglob);
+int dircache_glob_path_in(dircache_t* cache, const char* pattern, int flags, glob_t* pglob);
@@ -0,0 +1,22 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include "dircache.h"
+
+/**
+ * dircache-build: writes an offline index for an immutable tree
+ * Load the result at runtime with dircache_load_index
+ */
+int main(int argc, char** argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <root> <index file>\n", argv[0]);
+		return 1;
+	}
+	
+	if (dircache_build_index(argv[1], argv[2]) != 0) {
+		fprintf(stderr, "%s: failed to index %s: %s\n", argv[0], argv[1], strerror(errno));
+		return 1;
+	}
+	return 0;
+}